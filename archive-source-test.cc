@@ -0,0 +1,247 @@
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <zlib.h>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "archive-source.h"
+
+namespace {
+
+void Append16(std::string *out, uint32_t value) {
+  out->push_back(value & 0xFF);
+  out->push_back((value >> 8) & 0xFF);
+}
+
+void Append32(std::string *out, uint32_t value) {
+  Append16(out, value & 0xFFFF);
+  Append16(out, value >> 16);
+}
+
+// A ustar archive of the given members, in order.
+std::string Tar(const std::vector<std::pair<std::string, std::string>> &members) {
+  std::string tar;
+  for (auto &member : members) {
+    std::string header(512, '\0');
+    memcpy(&header[0], member.first.data(), member.first.size());
+    snprintf(&header[100], 8, "%07o", 0644);
+    snprintf(&header[124], 12, "%011o", (unsigned) member.second.size());
+    header[156] = '0';
+    memcpy(&header[257], "ustar", 5);
+    memset(&header[148], ' ', 8);
+    unsigned sum = 0;
+    for (char c : header) {
+      sum += (unsigned char) c;
+    }
+    snprintf(&header[148], 8, "%06o", sum);
+    tar += header + member.second;
+    tar.append((512 - member.second.size() % 512) % 512, '\0');
+  }
+  tar.append(1024, '\0');
+  return tar;
+}
+
+std::string Deflate(const std::string &data) {
+  z_stream stream;
+  memset(&stream, 0x00, sizeof(stream));
+  deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+               Z_DEFAULT_STRATEGY);
+  std::string out(deflateBound(&stream, data.size()), '\0');
+  stream.next_in = (Bytef *) data.data();
+  stream.avail_in = data.size();
+  stream.next_out = (Bytef *) &out[0];
+  stream.avail_out = out.size();
+  deflate(&stream, Z_FINISH);
+  out.resize(stream.total_out);
+  deflateEnd(&stream);
+  return out;
+}
+
+// A zip of the given members, deflated or stored, with offsets counted from
+// the start of the zip itself even when a prefix is put in front of it.
+std::string Zip(const std::vector<std::pair<std::string, std::string>> &members,
+                bool deflated, const std::string &prefix = "") {
+  std::string local;
+  std::string central;
+  for (auto &member : members) {
+    std::string body = deflated ? Deflate(member.second) : member.second;
+    uint32_t crc = crc32(0, (const Bytef *) member.second.data(),
+                         member.second.size());
+    uint32_t offset = local.size();
+    Append32(&local, 0x04034b50);
+    Append16(&local, 20);
+    Append16(&local, 0);
+    Append16(&local, deflated ? 8 : 0);
+    Append32(&local, 0);
+    Append32(&local, crc);
+    Append32(&local, body.size());
+    Append32(&local, member.second.size());
+    Append16(&local, member.first.size());
+    Append16(&local, 0);
+    local += member.first + body;
+
+    Append32(&central, 0x02014b50);
+    Append16(&central, 20);
+    Append16(&central, 20);
+    Append16(&central, 0);
+    Append16(&central, deflated ? 8 : 0);
+    Append32(&central, 0);
+    Append32(&central, crc);
+    Append32(&central, body.size());
+    Append32(&central, member.second.size());
+    Append16(&central, member.first.size());
+    Append16(&central, 0);
+    Append16(&central, 0);
+    Append16(&central, 0);
+    Append16(&central, 0);
+    Append32(&central, 0);
+    Append32(&central, offset);
+    central += member.first;
+  }
+  std::string end;
+  Append32(&end, 0x06054b50);
+  Append16(&end, 0);
+  Append16(&end, 0);
+  Append16(&end, members.size());
+  Append16(&end, members.size());
+  Append32(&end, central.size());
+  Append32(&end, local.size());
+  Append16(&end, 0);
+  return prefix + local + central + end;
+}
+
+std::string WriteArchive(const std::string &name, const std::string &data) {
+  std::string path = tensorflow::testing::TmpDir() + "/" + name;
+  std::ofstream(path, std::ios::binary) << data;
+  return path;
+}
+
+struct Collected {
+  std::mutex lock;
+  std::map<std::string, std::string> members;
+};
+
+void Collect(const std::string &key, const char *data, size_t size,
+             void *this_) {
+  Collected *collected = (Collected *) this_;
+  std::lock_guard<std::mutex> lock(collected->lock);
+  collected->members[key] = std::string(data, size);
+}
+
+Config *ArchiveConfig() {
+  return LoadTestConfig("archive-source", {
+    {"archive", {{"enabled", true}, {"max-member-mb", 1}}}
+  });
+}
+
+const std::vector<std::string> kFilters = {"jpg", "png", "gif"};
+
+TEST(ArchiveSourceTest, WalksTarMembersByFilter) {
+  ArchiveSource source(ArchiveConfig());
+  std::string path = WriteArchive("walk.tar", Tar({
+    {"a.jpg", "jpeg bytes"}, {"notes.txt", "skip me"},
+    {"dir/b.png", std::string(700, 'p')}}));
+  Collected collected;
+  EXPECT_EQ(2, source.walk(path, kFilters, Collect, &collected));
+  EXPECT_EQ("jpeg bytes", collected.members[path + "!a.jpg"]);
+  EXPECT_EQ(std::string(700, 'p'), collected.members[path + "!dir/b.png"]);
+  EXPECT_EQ(2u, collected.members.size());
+}
+
+TEST(ArchiveSourceTest, WalksStoredAndDeflatedZips) {
+  ArchiveSource source(ArchiveConfig());
+  for (bool deflated : {false, true}) {
+    std::string path = WriteArchive("walk.zip", Zip({
+      {"a.jpg", std::string(5000, 'a')}, {"notes.txt", "skip me"},
+      {"b.gif", "gif bytes"}}, deflated));
+    Collected collected;
+    EXPECT_EQ(2, source.walk(path, kFilters, Collect, &collected));
+    EXPECT_EQ(std::string(5000, 'a'), collected.members[path + "!a.jpg"]);
+    EXPECT_EQ("gif bytes", collected.members[path + "!b.gif"]);
+  }
+}
+
+TEST(ArchiveSourceTest, FindsZipBehindAPrefix) {
+  ArchiveSource source(ArchiveConfig());
+  // A self-extractor stub in front; without the end record this would be
+  // taken for a tar and nothing found.
+  std::string path = WriteArchive("sfx.zip", Zip({
+    {"a.jpg", std::string(3000, 'a')}}, true, std::string(1500, 'M')));
+  Collected collected;
+  EXPECT_EQ(1, source.walk(path, kFilters, Collect, &collected));
+  EXPECT_EQ(std::string(3000, 'a'), collected.members[path + "!a.jpg"]);
+}
+
+TEST(ArchiveSourceTest, SkipsOversizedMembers) {
+  ArchiveSource source(ArchiveConfig());
+  std::vector<std::pair<std::string, std::string>> members = {
+    {"large.jpg", std::string(2 * 1024 * 1024, 'l')}, {"small.jpg", "small"}};
+  std::vector<std::string> paths = {
+    WriteArchive("large.zip", Zip(members, true)),
+    WriteArchive("large.tar", Tar(members))};
+  for (auto &path : paths) {
+    Collected collected;
+    EXPECT_EQ(1, source.walk(path, kFilters, Collect, &collected)) << path;
+    EXPECT_EQ("small", collected.members[path + "!small.jpg"]) << path;
+    EXPECT_EQ(1u, collected.members.size()) << path;
+  }
+}
+
+TEST(ArchiveSourceTest, ConcurrentWalksKeepTheirOwnBuffers) {
+  ArchiveSource source(ArchiveConfig());
+  const int kWalkers = 4;
+  const int kMembers = 50;
+  std::vector<std::string> paths;
+  for (int walker = 0; walker < kWalkers; ++walker) {
+    std::vector<std::pair<std::string, std::string>> members;
+    for (int member = 0; member < kMembers; ++member) {
+      members.push_back({std::to_string(member) + ".jpg",
+                         std::string(20000 + member, 'a' + walker)});
+    }
+    paths.push_back(WriteArchive("concurrent-" + std::to_string(walker) + ".zip",
+                                 Zip(members, true)));
+  }
+
+  // Each member is checked while the walk is still on it, before the buffer
+  // moves on to the next one.
+  struct Checked {
+    char expected;
+    int bad;
+  };
+  auto check = [](const std::string &key, const char *data, size_t size,
+                  void *this_) {
+    Checked *checked = (Checked *) this_;
+    for (size_t pos = 0; pos < size; ++pos) {
+      if (data[pos] != checked->expected) {
+        checked->bad++;
+        return;
+      }
+    }
+  };
+  std::vector<Checked> checked(kWalkers);
+  std::vector<std::thread> threads;
+  for (int walker = 0; walker < kWalkers; ++walker) {
+    checked[walker] = {(char) ('a' + walker), 0};
+    threads.emplace_back([&, walker] {
+      for (int round = 0; round < 5; ++round) {
+        EXPECT_EQ(kMembers, source.walk(paths[walker], kFilters, check,
+                                        &checked[walker]));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  for (int walker = 0; walker < kWalkers; ++walker) {
+    EXPECT_EQ(0, checked[walker].bad) << "walker " << walker;
+  }
+}
+
+}  // namespace
@@ -0,0 +1,333 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <glog/logging.h>
+
+#include "archive-source.h"
+#include "trace.h"
+
+static const size_t kTarBlock = 512;
+static const uint32_t kZipLocalHeader = 0x04034b50;
+static const uint32_t kZipCentralHeader = 0x02014b50;
+static const uint32_t kZipEndOfDirectory = 0x06054b50;
+
+static uint16_t Le16(const char *p) {
+  const unsigned char *u = (const unsigned char *) p;
+  return u[0] | (u[1] << 8);
+}
+
+static uint32_t Le32(const char *p) {
+  const unsigned char *u = (const unsigned char *) p;
+  return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t) u[3] << 24);
+}
+
+static bool EndsWith(const std::string &text, const std::string &suffix) {
+  return text.length() >= suffix.length() &&
+    text.compare(text.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+// A NUL padded header field.
+static std::string Field(const char *p, size_t length) {
+  size_t end = 0;
+  while (end < length && p[end] != '\0') {
+    end++;
+  }
+  return std::string(p, end);
+}
+
+// Tar sizes are octal, or base-256 with the top bit set for members over 8GB.
+static uint64_t TarSize(const char *p) {
+  const unsigned char *u = (const unsigned char *) p;
+  uint64_t size = 0;
+  if (u[0] & 0x80) {
+    for (int pos = 4; pos < 12; ++pos) {
+      size = (size << 8) | u[pos];
+    }
+    return size;
+  }
+  for (int pos = 0; pos < 12; ++pos) {
+    if (p[pos] >= '0' && p[pos] <= '7') {
+      size = (size << 3) | (p[pos] - '0');
+    } else if (size > 0) {
+      break;
+    }
+  }
+  return size;
+}
+
+// The "path" record of a pax extended header, if it has one.
+static std::string PaxPath(const char *data, size_t size) {
+  size_t pos = 0;
+  while (pos < size) {
+    size_t space = pos;
+    while (space < size && data[space] != ' ') {
+      space++;
+    }
+    size_t length = strtoul(std::string(data + pos, space - pos).c_str(), NULL, 10);
+    if (length == 0 || pos + length > size) {
+      break;
+    }
+    std::string record(data + space + 1, length - (space + 1 - pos));
+    if (record.compare(0, 5, "path=") == 0) {
+      return record.substr(5, record.length() - 6);
+    }
+    pos += length;
+  }
+  return std::string();
+}
+
+// The offset of the end of central directory record, or npos if this isn't a
+// zip. The record sits at the very end, unless there is an archive comment
+// after it, in which case the comment has to run exactly to the end.
+static size_t ZipEnd(const char *data, size_t size) {
+  if (size < 22) {
+    return std::string::npos;
+  }
+  size_t first = size > 22 + 65535 ? size - 22 - 65535 : 0;
+  for (size_t pos = size - 22; ; --pos) {
+    if (Le32(data + pos) == kZipEndOfDirectory &&
+        pos + 22 + Le16(data + pos + 20) == size &&
+        (uint64_t) Le32(data + pos + 12) + Le32(data + pos + 16) <= pos) {
+      return pos;
+    }
+    if (pos == first) {
+      return std::string::npos;
+    }
+  }
+}
+
+ArchiveSource::ArchiveSource(Config *config) {
+  this->config = config;
+}
+
+ArchiveSource::~ArchiveSource() {
+}
+
+bool ArchiveSource::isArchive(const std::string &path) {
+  return EndsWith(path, ".tar") || EndsWith(path, ".zip");
+}
+
+bool ArchiveSource::matches(const std::string &name,
+                            const std::vector<std::string> &filters) {
+  size_t dot = name.find_last_of('.');
+  if (dot == std::string::npos || name.back() == '/') {
+    return false;
+  }
+  std::string extension = name.substr(dot + 1);
+  for (auto &filter : filters) {
+    if (extension == filter) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int ArchiveSource::walk(const std::string &path,
+                        const std::vector<std::string> &filters,
+                        OnMember onMember, void *this_) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG(ERROR) << "Unable to open archive " << path;
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    return st.st_size == 0 ? 0 : -1;
+  }
+  size_t size = st.st_size;
+  void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    LOG(ERROR) << "Unable to map archive " << path;
+    return -1;
+  }
+  // Tar is read front to back; for zip the members are in the same order as
+  // the central directory, so it's close enough.
+  madvise(mapped, size, MADV_SEQUENTIAL);
+
+  Walk walk;
+  walk.path = path;
+  walk.filters = &filters;
+  walk.onMember = onMember;
+  walk.this_ = this_;
+  walk.members = 0;
+  walk.bytes = 0;
+  walk.skipped = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  const char *data = (const char *) mapped;
+  size_t end = ZipEnd(data, size);
+  int found;
+  if (end != std::string::npos) {
+    found = walkZip(&walk, data, size, end);
+  } else {
+    found = walkTar(&walk, data, size);
+  }
+  munmap(mapped, size);
+
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+  double megabytes = walk.bytes / (1024.0 * 1024.0);
+  LOG(INFO) << "Archive " << path << ": " << walk.members << " members, " <<
+    megabytes << " MB in " << seconds << " s (" <<
+    (seconds > 0 ? walk.members / seconds : 0) << " members/sec, " <<
+    (seconds > 0 ? megabytes / seconds : 0) << " MB/s), skipped " <<
+    walk.skipped;
+  return found;
+}
+
+int ArchiveSource::walkTar(Walk *walk, const char *data, size_t size) {
+  const std::string &path = walk->path;
+  uint64_t max_member = config->getArchiveMaxMemberBytes();
+  int found = 0;
+  size_t offset = 0;
+  std::string long_name;
+  while (offset + kTarBlock <= size) {
+    const char *header = data + offset;
+    if (header[0] == '\0') {
+      // Two zero blocks end the archive; one is enough to stop.
+      break;
+    }
+    uint64_t member_size = TarSize(header + 124);
+    char type = header[156];
+    const char *member = header + kTarBlock;
+    if (member_size > size - offset - kTarBlock) {
+      LOG(ERROR) << path << ": truncated at offset " << offset;
+      break;
+    }
+    offset += kTarBlock + (member_size + kTarBlock - 1) / kTarBlock * kTarBlock;
+
+    // GNU and pax long names apply to the member that follows.
+    if (type == 'L') {
+      long_name = Field(member, member_size);
+      continue;
+    }
+    if (type == 'x') {
+      long_name = PaxPath(member, member_size);
+      continue;
+    }
+    std::string name = long_name;
+    long_name.clear();
+    if (type != '0' && type != '\0' && type != '7') {
+      continue;
+    }
+    if (name.empty()) {
+      name = Field(header, 100);
+      if (Field(header + 257, 5) == "ustar" && header[345] != '\0') {
+        name = Field(header + 345, 155) + "/" + name;
+      }
+    }
+    if (!matches(name, *walk->filters)) {
+      continue;
+    }
+    if (member_size > max_member) {
+      LOG(WARNING) << path << "!" << name << ": skipped (" << member_size <<
+        " bytes)";
+      walk->skipped++;
+      continue;
+    }
+    walk->members++;
+    walk->bytes += member_size;
+    found++;
+    walk->onMember(path + "!" + name, member, member_size, walk->this_);
+  }
+  return found;
+}
+
+int ArchiveSource::walkZip(Walk *walk, const char *data, size_t size,
+                           size_t end) {
+  const std::string &path = walk->path;
+  // The central directory ends where the end record starts. Anything in front
+  // of the zip, like a self-extractor stub, shifts it from where its offset
+  // says, and every other offset by the same amount.
+  size_t offset = end - Le32(data + end + 12);
+  size_t prefix = offset - Le32(data + end + 16);
+  uint16_t entries = Le16(data + end + 10);
+  uint64_t max_member = config->getArchiveMaxMemberBytes();
+  int found = 0;
+  for (uint16_t entry = 0; entry < entries; ++entry) {
+    if (offset + 46 > size || Le32(data + offset) != kZipCentralHeader) {
+      LOG(ERROR) << path << ": corrupt central directory at offset " << offset;
+      break;
+    }
+    const char *central = data + offset;
+    uint16_t flags = Le16(central + 8);
+    uint16_t method = Le16(central + 10);
+    uint32_t compressed = Le32(central + 20);
+    uint32_t uncompressed = Le32(central + 24);
+    uint16_t name_length = Le16(central + 28);
+    size_t local = prefix + Le32(central + 42);
+    std::string name(central + 46, std::min<size_t>(name_length, size - offset - 46));
+    offset += 46 + name_length + Le16(central + 30) + Le16(central + 32);
+
+    if (!matches(name, *walk->filters)) {
+      continue;
+    }
+    if ((flags & 0x1) || compressed == 0xFFFFFFFF ||
+        uncompressed == 0xFFFFFFFF || uncompressed > max_member ||
+        (method != 0 && method != 8)) {
+      LOG(WARNING) << path << "!" << name << ": skipped (method " << method <<
+        ", " << uncompressed << " bytes" << ((flags & 0x1) ? ", encrypted" : "") <<
+        ")";
+      walk->skipped++;
+      continue;
+    }
+    if (local + 30 > size || Le32(data + local) != kZipLocalHeader) {
+      LOG(ERROR) << path << "!" << name << ": bad local header";
+      walk->skipped++;
+      continue;
+    }
+    size_t start = local + 30 + Le16(data + local + 26) + Le16(data + local + 28);
+    if (start > size || compressed > size - start) {
+      LOG(ERROR) << path << "!" << name << ": truncated";
+      walk->skipped++;
+      continue;
+    }
+
+    std::string key = path + "!" + name;
+    const char *member = data + start;
+    size_t member_size = compressed;
+    if (method == 8) {
+      TraceSpan span("inflate", key);
+      if (!inflate(walk, member, compressed, uncompressed)) {
+        LOG(ERROR) << key << ": inflate failed";
+        walk->skipped++;
+        continue;
+      }
+      member = walk->inflated.data();
+      member_size = walk->inflated.size();
+    }
+    walk->members++;
+    walk->bytes += member_size;
+    found++;
+    walk->onMember(key, member, member_size, walk->this_);
+  }
+  return found;
+}
+
+// Raw deflate into the walk's buffer, which must come out at exactly the size
+// the central directory promised.
+bool ArchiveSource::inflate(Walk *walk, const char *data, size_t size,
+                            size_t expected) {
+  std::string &inflated = walk->inflated;
+  inflated.resize(expected);
+  z_stream stream;
+  memset(&stream, 0x00, sizeof(stream));
+  if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = size;
+  stream.next_out = (Bytef *) &inflated[0];
+  stream.avail_out = expected;
+  int result = ::inflate(&stream, Z_FINISH);
+  bool ok = result == Z_STREAM_END && stream.total_out == expected;
+  inflateEnd(&stream);
+  return ok;
+}
@@ -0,0 +1,57 @@
+#ifndef SRC_ARCHIVE_SOURCE_H_
+#define SRC_ARCHIVE_SOURCE_H_
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+typedef void (*OnMember) (const std::string &key, const char *data,
+      size_t size, void *this_);
+
+// Reads images straight out of tar and zip archives, so a backlog delivered
+// as archives doesn't have to be extracted to disk first. The archive is
+// mapped and walked front to back; members whose extension is in the filters
+// are handed to OnMember as "<archive>!<member>" along with their bytes.
+//
+// Tar and stored zip members point straight into the mapping. Deflated zip
+// members are inflated into a buffer reused across the members of one walk.
+// Members of either kind declaring more than "archive.max-member-mb" are
+// skipped, zip members before anything is inflated. Zips are found by their end of central directory
+// record, so self-extracting archives with a stub in front are read too.
+//
+// Each walk keeps its buffer and counters to itself, so the same source can
+// be walked from several threads at once.
+class ArchiveSource {
+private:
+  struct Walk {
+    std::string path;
+    const std::vector<std::string> *filters;
+    OnMember onMember;
+    void *this_;
+    std::string inflated;
+    uint64_t members;
+    uint64_t bytes;
+    uint64_t skipped;
+  };
+
+  Config *config;
+
+  bool matches(const std::string &name, const std::vector<std::string> &filters);
+  int walkTar(Walk *walk, const char *data, size_t size);
+  int walkZip(Walk *walk, const char *data, size_t size, size_t end);
+  bool inflate(Walk *walk, const char *data, size_t size, size_t expected);
+public:
+  ArchiveSource(Config *config);
+  ~ArchiveSource();
+
+  static bool isArchive(const std::string &path);
+  // Returns the number of members handed to onMember, or -1 if the archive
+  // could not be read at all.
+  int walk(const std::string &path, const std::vector<std::string> &filters,
+        OnMember onMember, void *this_);
+};
+
+#endif /* SRC_ARCHIVE_SOURCE_H_ */
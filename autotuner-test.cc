@@ -0,0 +1,107 @@
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "autotuner.h"
+
+// Drives the tuner one interval at a time, without its thread, against a
+// prefetcher that is never fed.
+class AutotunerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    Config *config = LoadTestConfig("autotuner", {
+      {"prefetch", {
+        {"depth", 16},
+        {"readers", 1},
+        {"batch-size", 1},
+        {"batch-deadline-ms", 0}
+      }},
+      {"autotune", {
+        {"enabled", true},
+        {"p99-target-ms", 100},
+        {"max-readers", 8},
+        {"max-batch-size", 8},
+        {"max-batch-deadline-ms", 10},
+        {"min-improvement", 0.05}
+      }}
+    });
+    // The prefetcher's threads wait for files for the life of the process,
+    // so it is never deleted.
+    prefetcher = new Prefetcher(config, NULL);
+    prefetcher->init(NULL, Discard, NULL, 8);
+    tuner = new Autotuner(config);
+    tuner->attach(prefetcher);
+  }
+
+  void TearDown() override {
+    delete tuner;
+  }
+
+  static void Discard(const std::vector<PrefetchedFile *> &files,
+                      void *this_) {}
+
+  // One second in which labels images came out, each p99Ms after discovery.
+  void Interval(int images, int p99Ms) {
+    for (int image = 0; image < images; ++image) {
+      tuner->record(p99Ms * 1000LL);
+    }
+    tuner->tune(1.0);
+  }
+
+  Prefetcher *prefetcher;
+  Autotuner *tuner;
+};
+
+namespace {
+
+TEST_F(AutotunerTest, KeepsAStepThatDoesBetter) {
+  Interval(100, 50);
+  // The first step is one more reader.
+  EXPECT_EQ(2, prefetcher->getReaders());
+
+  // What finishes right after the change says nothing about it; were this
+  // judged, the step would be reverted.
+  Interval(100, 500);
+  EXPECT_EQ(2, prefetcher->getReaders());
+
+  Interval(200, 50);
+  // Kept, and the next step on the same knob is being tried.
+  EXPECT_EQ(3, prefetcher->getReaders());
+}
+
+TEST_F(AutotunerTest, RevertsAStepThatDoesWorse) {
+  Interval(100, 50);
+  EXPECT_EQ(2, prefetcher->getReaders());
+  Interval(100, 50);
+
+  // Slower: back to one reader. Fewer than one can't be tried, so the next
+  // step is a bigger batch.
+  Interval(80, 50);
+  EXPECT_EQ(1, prefetcher->getReaders());
+  EXPECT_EQ(2, prefetcher->getBatchSize());
+}
+
+TEST_F(AutotunerTest, MeetingTheTargetBeatsThroughput) {
+  Interval(100, 500);
+  EXPECT_EQ(2, prefetcher->getReaders());
+  Interval(100, 500);
+
+  // Fewer images, but under the p99 target.
+  Interval(60, 50);
+  EXPECT_EQ(3, prefetcher->getReaders());
+}
+
+TEST_F(AutotunerTest, TooFewSamplesLeaveTheTrialRunning) {
+  Interval(100, 50);
+  Interval(100, 50);
+  EXPECT_EQ(2, prefetcher->getReaders());
+
+  Interval(5, 50);
+  EXPECT_EQ(2, prefetcher->getReaders());
+  Interval(200, 50);
+  EXPECT_EQ(3, prefetcher->getReaders());
+}
+
+}  // namespace
@@ -0,0 +1,237 @@
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <glog/logging.h>
+
+#include "autotuner.h"
+
+using ChCppUtils::ThreadJob;
+
+// Intervals to hold a converged setting before exploring again.
+static const int kSettleIntervals = 6;
+// Fewer labels than this in an interval say nothing about the setting.
+static const size_t kMinSamples = 20;
+
+Autotuner::Autotuner(Config *config) {
+  this->config = config;
+  prefetcher = NULL;
+  mPool = NULL;
+  mBestMeasurement.rate = 0;
+  mBestMeasurement.p99Ms = 0;
+  mTrial = false;
+  mDiscard = false;
+  mKnob = KNOB_READERS;
+  mDirection = 1;
+  mFailures = 0;
+  mSettled = 0;
+}
+
+Autotuner::~Autotuner() {
+}
+
+void Autotuner::attach(Prefetcher *prefetcher) {
+  this->prefetcher = prefetcher;
+  mCurrent.value[KNOB_READERS] = prefetcher->getReaders();
+  mCurrent.value[KNOB_BATCH_SIZE] = prefetcher->getBatchSize();
+  mCurrent.value[KNOB_BATCH_DEADLINE] = prefetcher->getBatchDeadlineMs();
+  mBest = mCurrent;
+}
+
+void Autotuner::init(Prefetcher *prefetcher) {
+  attach(prefetcher);
+  mPool = new ThreadPool (1, false);
+  mPool->addJob(new ThreadJob (Autotuner::_tuneRoutine, this));
+  LOG(INFO) << "Autotune: p99 target " << config->getAutotuneP99TargetMs() <<
+    " ms, up to " << limit(KNOB_READERS) << " readers, batch " <<
+    limit(KNOB_BATCH_SIZE) << ", deadline " << limit(KNOB_BATCH_DEADLINE) <<
+    " ms";
+}
+
+void Autotuner::record(int64_t latencyUs) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mLatenciesUs.push_back(latencyUs);
+}
+
+const char *Autotuner::knobName(int knob) {
+  switch (knob) {
+    case KNOB_READERS: return "readers";
+    case KNOB_BATCH_SIZE: return "batch-size";
+    case KNOB_BATCH_DEADLINE: return "batch-deadline-ms";
+  }
+  return "unknown";
+}
+
+// A batch can't be bigger than the files queued ahead.
+int Autotuner::limit(int knob) {
+  switch (knob) {
+    case KNOB_READERS:
+      return std::max(1, config->getAutotuneMaxReaders());
+    case KNOB_BATCH_SIZE:
+      return std::max(1, std::min(config->getAutotuneMaxBatchSize(),
+                                  config->getPrefetchDepth()));
+    case KNOB_BATCH_DEADLINE:
+      return std::max(0, config->getAutotuneMaxBatchDeadlineMs());
+  }
+  return 0;
+}
+
+void Autotuner::apply(const Setting &setting) {
+  prefetcher->setReaders(setting.value[KNOB_READERS]);
+  prefetcher->setBatch(setting.value[KNOB_BATCH_SIZE],
+                       setting.value[KNOB_BATCH_DEADLINE]);
+  mDiscard = true;
+}
+
+// Takes the latencies recorded since the last call.
+bool Autotuner::measure(double seconds, Measurement *measurement) {
+  std::vector<int64_t> latencies;
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    latencies.swap(mLatenciesUs);
+  }
+  if (latencies.size() < kMinSamples || seconds <= 0) {
+    return false;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  size_t index = std::min(latencies.size() - 1, latencies.size() * 99 / 100);
+  measurement->rate = latencies.size() / seconds;
+  measurement->p99Ms = latencies[index] / 1000.0;
+  return true;
+}
+
+bool Autotuner::better(const Measurement &candidate, const Measurement &best) {
+  double target = config->getAutotuneP99TargetMs();
+  double margin = config->getAutotuneMinImprovement();
+  bool candidate_meets = candidate.p99Ms <= target;
+  bool best_meets = best.p99Ms <= target;
+  if (candidate_meets != best_meets) {
+    return candidate_meets;
+  }
+  if (candidate_meets) {
+    return candidate.rate > best.rate * (1.0 + margin);
+  }
+  return candidate.p99Ms < best.p99Ms * (1.0 - margin);
+}
+
+// Moves the current knob one step in the current direction; false if it is
+// already at its limit.
+bool Autotuner::step(Setting *setting) {
+  int value = setting->value[mKnob];
+  int moved = mDirection > 0 ? value + std::max(1, value / 2) :
+    value - std::max(1, value / 3);
+  int floor = mKnob == KNOB_BATCH_DEADLINE ? 0 : 1;
+  moved = std::min(std::max(moved, floor), limit(mKnob));
+  setting->value[mKnob] = moved;
+  return moved != value;
+}
+
+// Tries the other direction of the same knob, then the next knob.
+void Autotuner::nextMove() {
+  if (mDirection > 0) {
+    mDirection = -1;
+  } else {
+    mDirection = 1;
+    mKnob = (mKnob + 1) % KNOB_COUNT;
+  }
+}
+
+void * Autotuner::_tuneRoutine (void *arg, struct event_base *base) {
+  Autotuner *tuner = (Autotuner *) arg;
+  return tuner->tuneRoutine();
+}
+
+void *Autotuner::tuneRoutine () {
+  typedef std::chrono::steady_clock Clock;
+  std::chrono::milliseconds interval(
+    std::max(1000, config->getAutotuneIntervalMs()));
+  Clock::time_point last = Clock::now();
+  while (true) {
+    std::this_thread::sleep_for(interval);
+    Clock::time_point now = Clock::now();
+    double seconds = std::chrono::duration<double>(now - last).count();
+    last = now;
+    tune(seconds);
+  }
+  return NULL;
+}
+
+// One interval: judges the setting that just ran, then picks the next one.
+void Autotuner::tune(double seconds) {
+  if (mDiscard) {
+    // Labels finishing right after a change were queued and batched under
+    // the old setting, so the first interval of every setting is dropped.
+    Measurement stale;
+    measure(seconds, &stale);
+    mDiscard = false;
+    return;
+  }
+
+  Measurement measurement;
+  if (!measure(seconds, &measurement)) {
+    // Idle, or too little traffic to tell settings apart; leave any trial
+    // running until there is.
+    return;
+  }
+
+  if (mTrial) {
+    mTrial = false;
+    if (better(measurement, mBestMeasurement)) {
+      LOG(INFO) << "Autotune: keeping " << knobName(mKnob) << " " <<
+        mBest.value[mKnob] << " -> " << mCurrent.value[mKnob] << ", " <<
+        measurement.rate << " images/sec, p99 " << measurement.p99Ms <<
+        " ms (was " << mBestMeasurement.rate << ", " <<
+        mBestMeasurement.p99Ms << " ms)";
+      mBest = mCurrent;
+      mBestMeasurement = measurement;
+      mFailures = 0;
+    } else {
+      LOG(INFO) << "Autotune: reverting " << knobName(mKnob) << " " <<
+        mCurrent.value[mKnob] << " -> " << mBest.value[mKnob] << ", " <<
+        measurement.rate << " images/sec, p99 " << measurement.p99Ms <<
+        " ms (best " << mBestMeasurement.rate << ", " <<
+        mBestMeasurement.p99Ms << " ms)";
+      mCurrent = mBest;
+      apply(mCurrent);
+      mFailures++;
+      nextMove();
+    }
+  } else {
+    // A fresh reading of the setting being held.
+    mBestMeasurement = measurement;
+  }
+
+  if (mFailures >= 2 * KNOB_COUNT) {
+    if (mSettled == 0) {
+      LOG(INFO) << "Autotune: settled on readers " <<
+        mBest.value[KNOB_READERS] << ", batch-size " <<
+        mBest.value[KNOB_BATCH_SIZE] << ", batch-deadline-ms " <<
+        mBest.value[KNOB_BATCH_DEADLINE] << ", " << mBestMeasurement.rate <<
+        " images/sec, p99 " << mBestMeasurement.p99Ms << " ms";
+    }
+    if (++mSettled < kSettleIntervals) {
+      return;
+    }
+    mSettled = 0;
+    mFailures = 0;
+    return;
+  }
+
+  // Knobs already at their limit in the chosen direction are skipped.
+  Setting next = mBest;
+  bool moved = false;
+  for (int attempt = 0; attempt < 2 * KNOB_COUNT && !moved; ++attempt) {
+    moved = step(&next);
+    if (!moved) {
+      nextMove();
+    }
+  }
+  if (!moved) {
+    mFailures = 2 * KNOB_COUNT;
+    return;
+  }
+  LOG(INFO) << "Autotune: trying " << knobName(mKnob) << " " <<
+    mBest.value[mKnob] << " -> " << next.value[mKnob];
+  mCurrent = next;
+  apply(mCurrent);
+  mTrial = true;
+}
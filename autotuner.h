@@ -0,0 +1,87 @@
+#ifndef SRC_AUTOTUNER_H_
+#define SRC_AUTOTUNER_H_
+
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <event2/event.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+
+#include "config.h"
+#include "prefetcher.h"
+
+using ChCppUtils::ThreadPool;
+
+// Tunes the reader count, batch size and batch deadline of the prefetcher
+// while running, to get the most images/sec with the p99 of discovery to
+// label latency under "autotune.p99-target-ms".
+//
+// Every "autotune.interval-ms" it measures the setting that just ran and
+// compares it with the best so far. It then changes one knob one step, up
+// or down, and keeps the change only if it beats the best by
+// "autotune.min-improvement". Steps grow with the value, so a 64 core host
+// gets from 1 to 64 readers in a handful of intervals. Any setting that meets
+// the target beats any that doesn't; between two that miss it, the lower p99
+// wins. Once no single step helps, the setting is held for a while and then
+// explored again, in case the load has changed. The interval right after a
+// change is not judged, since what finishes in it was mostly queued under
+// the setting before. Every decision is logged.
+class Autotuner {
+private:
+  friend class AutotunerTest;
+
+  enum Knob {
+    KNOB_READERS,
+    KNOB_BATCH_SIZE,
+    KNOB_BATCH_DEADLINE,
+    KNOB_COUNT
+  };
+
+  struct Setting {
+    int value[KNOB_COUNT];
+  };
+
+  struct Measurement {
+    double rate;
+    double p99Ms;
+  };
+
+  Config *config;
+  Prefetcher *prefetcher;
+  ThreadPool *mPool;
+
+  std::mutex mLock;
+  std::vector<int64_t> mLatenciesUs;
+
+  Setting mCurrent;
+  Setting mBest;
+  Measurement mBestMeasurement;
+  bool mTrial;
+  bool mDiscard;
+  int mKnob;
+  int mDirection;
+  int mFailures;
+  int mSettled;
+
+  static void *_tuneRoutine (void *arg, struct event_base *base);
+  void *tuneRoutine ();
+
+  void attach(Prefetcher *prefetcher);
+  void tune(double seconds);
+
+  bool measure(double seconds, Measurement *measurement);
+  bool better(const Measurement &candidate, const Measurement &best);
+  bool step(Setting *setting);
+  void nextMove();
+  void apply(const Setting &setting);
+  int limit(int knob);
+  static const char *knobName(int knob);
+public:
+  Autotuner(Config *config);
+  ~Autotuner();
+  void init(Prefetcher *prefetcher);
+  // Discovery to label latency of one image.
+  void record(int64_t latencyUs);
+};
+
+#endif /* SRC_AUTOTUNER_H_ */
@@ -47,12 +47,80 @@
 using std::ifstream;
 
 Config::Config() :
-	ChCppUtils::Config("/etc/ch-tf-label-image-client/ch-tf-label-image-client.json",
+	Config("/etc/ch-tf-label-image-client/ch-tf-label-image-client.json",
 			"./tensorflow/examples/ch-tf-label-image-client/ch-tf-label-image-client.json") {
+}
+
+Config::Config(const string &path) : Config(path, path) {
+}
+
+Config::Config(const string &etcPath, const string &localPath) :
+	ChCppUtils::Config(etcPath, localPath) {
+        valid = true;
         esProtocol = "http";
         esHostname = "127.0.0.1";
         esPort = 9200;
         esPrefixPath = "/example/photos/index";
+
+        publisherMaxInMemory = 10000;
+        publisherMaxInFlight = 16;
+        publisherMaxAttempts = 8;
+        publisherBackoffBaseMs = 100;
+        publisherBackoffMaxMs = 30000;
+        publisherRequestTimeoutMs = 10000;
+        publisherSpoolPath = "/tmp/ch-tf-label-image-client.spool";
+        publisherSpoolMaxMb = 1024;
+
+        statsReportEvery = 100;
+        selfTest = false;
+
+        decodeMemoryBudgetMb = 1024;
+        decodeReduceAboveMb = 256;
+        decodeMaxMegapixels = 400;
+
+        warmUpBatchSizes = {1};
+
+        shardIndex = 0;
+        shardCount = 1;
+        shardId = "";
+        shardLeaseDir = "";
+        shardLeaseTtlMs = 15000;
+        shardHeartbeatMs = 3000;
+
+        traceEnabled = false;
+        traceSampleEvery = 1;
+        traceRingSize = 4096;
+        traceDumpIntervalMs = 0;
+        traceDumpDir = "/tmp";
+
+        gifFrameStride = 1;
+        gifMaxFrames = 8;
+        gifAggregate = "max";
+        multiCropEnabled = false;
+        multiCropGrid = 2;
+        multiCropFull = true;
+        multiCropAggregate = "mean";
+        archiveEnabled = true;
+        archiveMaxMemberMb = 64;
+        serverBind = "127.0.0.1";
+        serverPort = 9870;
+        serverMaxConnections = 64;
+        serverMaxBatch = 8;
+        serverBatchDeadlineMs = 5;
+        serverMaxRequestMb = 32;
+        prefetchEnabled = true;
+        prefetchDepth = 16;
+        prefetchReaders = 4;
+        prefetchMaxBytesMb = 256;
+        prefetchBatchSize = 1;
+        prefetchBatchDeadlineMs = 0;
+        autotuneEnabled = false;
+        autotuneIntervalMs = 10000;
+        autotuneP99TargetMs = 2000;
+        autotuneMaxReaders = 16;
+        autotuneMaxBatchSize = 16;
+        autotuneMaxBatchDeadlineMs = 50;
+        autotuneMinImprovement = 0.05;
 }
 
 Config::~Config() {
@@ -61,6 +129,7 @@ Config::~Config() {
 
 bool Config::populateConfigValues() {
 	LOG(INFO) << "<-----------------------Config";
+        valid = true;
 
         esProtocol = mJson["elastic-search"]["protocol"];
         LOG(INFO) << "elastic-search.protocol : " << esProtocol;
@@ -74,8 +143,168 @@ bool Config::populateConfigValues() {
         esPrefixPath = mJson["elastic-search"]["prefix-path"];
         LOG(INFO) << "elastic-search.prefix-path : " << esPrefixPath;
 
+        if (mJson["publisher"].is_object()) {
+                auto &publisher = mJson["publisher"];
+                publisherMaxInMemory = publisher.value("max-in-memory", publisherMaxInMemory);
+                publisherMaxInFlight = publisher.value("max-in-flight", publisherMaxInFlight);
+                publisherMaxAttempts = publisher.value("max-attempts", publisherMaxAttempts);
+                publisherBackoffBaseMs = publisher.value("backoff-base-ms", publisherBackoffBaseMs);
+                publisherBackoffMaxMs = publisher.value("backoff-max-ms", publisherBackoffMaxMs);
+                publisherRequestTimeoutMs = publisher.value("request-timeout-ms", publisherRequestTimeoutMs);
+                publisherSpoolPath = publisher.value("spool-path", publisherSpoolPath);
+                publisherSpoolMaxMb = publisher.value("spool-max-mb", publisherSpoolMaxMb);
+        }
+        LOG(INFO) << "publisher.max-in-memory : " << publisherMaxInMemory;
+        LOG(INFO) << "publisher.max-in-flight : " << publisherMaxInFlight;
+        LOG(INFO) << "publisher.max-attempts : " << publisherMaxAttempts;
+        LOG(INFO) << "publisher.backoff-base-ms : " << publisherBackoffBaseMs;
+        LOG(INFO) << "publisher.backoff-max-ms : " << publisherBackoffMaxMs;
+        LOG(INFO) << "publisher.request-timeout-ms : " << publisherRequestTimeoutMs;
+        LOG(INFO) << "publisher.spool-path : " << publisherSpoolPath;
+        LOG(INFO) << "publisher.spool-max-mb : " << publisherSpoolMaxMb;
+
+        if (mJson["stats"].is_object()) {
+                statsReportEvery = mJson["stats"].value("report-every", statsReportEvery);
+        }
+        LOG(INFO) << "stats.report-every : " << statsReportEvery;
+
+        selfTest = mJson.value("self-test", selfTest);
+        LOG(INFO) << "self-test : " << selfTest;
+
+        if (mJson["decode"].is_object()) {
+                auto &decode = mJson["decode"];
+                decodeMemoryBudgetMb = decode.value("memory-budget-mb", decodeMemoryBudgetMb);
+                decodeReduceAboveMb = decode.value("reduce-above-mb", decodeReduceAboveMb);
+                decodeMaxMegapixels = decode.value("max-megapixels", decodeMaxMegapixels);
+        }
+        LOG(INFO) << "decode.memory-budget-mb : " << decodeMemoryBudgetMb;
+        LOG(INFO) << "decode.reduce-above-mb : " << decodeReduceAboveMb;
+        LOG(INFO) << "decode.max-megapixels : " << decodeMaxMegapixels;
+
+        if (mJson["warm-up"].is_object()) {
+                warmUpBatchSizes = mJson["warm-up"].value("batch-sizes", warmUpBatchSizes);
+        }
+        for (int batch : warmUpBatchSizes) {
+                LOG(INFO) << "warm-up.batch-sizes : " << batch;
+        }
+
+        if (mJson["shard"].is_object()) {
+                auto &shard = mJson["shard"];
+                shardIndex = shard.value("index", shardIndex);
+                shardCount = shard.value("count", shardCount);
+                shardId = shard.value("id", shardId);
+                shardLeaseDir = shard.value("lease-dir", shardLeaseDir);
+                shardLeaseTtlMs = shard.value("lease-ttl-ms", shardLeaseTtlMs);
+                shardHeartbeatMs = shard.value("heartbeat-ms", shardHeartbeatMs);
+        }
+        LOG(INFO) << "shard.index : " << shardIndex;
+        LOG(INFO) << "shard.count : " << shardCount;
+        LOG(INFO) << "shard.id : " << shardId;
+        LOG(INFO) << "shard.lease-dir : " << shardLeaseDir;
+        LOG(INFO) << "shard.lease-ttl-ms : " << shardLeaseTtlMs;
+        LOG(INFO) << "shard.heartbeat-ms : " << shardHeartbeatMs;
+        if (shardCount < 1 || shardIndex < 0 || shardIndex >= shardCount) {
+                LOG(ERROR) << "shard.index must be in [0, shard.count) and " <<
+                        "shard.count at least 1";
+                valid = false;
+        }
+
+        if (mJson["trace"].is_object()) {
+                auto &trace = mJson["trace"];
+                traceEnabled = trace.value("enabled", traceEnabled);
+                traceSampleEvery = trace.value("sample-every", traceSampleEvery);
+                traceRingSize = trace.value("ring-size", traceRingSize);
+                traceDumpIntervalMs = trace.value("dump-interval-ms", traceDumpIntervalMs);
+                traceDumpDir = trace.value("dump-dir", traceDumpDir);
+        }
+        LOG(INFO) << "trace.enabled : " << traceEnabled;
+        LOG(INFO) << "trace.sample-every : " << traceSampleEvery;
+        LOG(INFO) << "trace.ring-size : " << traceRingSize;
+        LOG(INFO) << "trace.dump-interval-ms : " << traceDumpIntervalMs;
+        LOG(INFO) << "trace.dump-dir : " << traceDumpDir;
+
+        if (mJson["gif"].is_object()) {
+                auto &gif = mJson["gif"];
+                gifFrameStride = gif.value("frame-stride", gifFrameStride);
+                gifMaxFrames = gif.value("max-frames", gifMaxFrames);
+                gifAggregate = gif.value("aggregate", gifAggregate);
+        }
+        LOG(INFO) << "gif.frame-stride : " << gifFrameStride;
+        LOG(INFO) << "gif.max-frames : " << gifMaxFrames;
+        LOG(INFO) << "gif.aggregate : " << gifAggregate;
+
+        if (mJson["multi-crop"].is_object()) {
+                auto &multiCrop = mJson["multi-crop"];
+                multiCropEnabled = multiCrop.value("enabled", multiCropEnabled);
+                multiCropGrid = multiCrop.value("grid", multiCropGrid);
+                multiCropFull = multiCrop.value("full", multiCropFull);
+                multiCropAggregate = multiCrop.value("aggregate", multiCropAggregate);
+        }
+        LOG(INFO) << "multi-crop.enabled : " << multiCropEnabled;
+        LOG(INFO) << "multi-crop.grid : " << multiCropGrid;
+        LOG(INFO) << "multi-crop.full : " << multiCropFull;
+        LOG(INFO) << "multi-crop.aggregate : " << multiCropAggregate;
+
+        if (mJson["archive"].is_object()) {
+                auto &archive = mJson["archive"];
+                archiveEnabled = archive.value("enabled", archiveEnabled);
+                archiveMaxMemberMb = archive.value("max-member-mb", archiveMaxMemberMb);
+        }
+        LOG(INFO) << "archive.enabled : " << archiveEnabled;
+        LOG(INFO) << "archive.max-member-mb : " << archiveMaxMemberMb;
+
+        if (mJson["server"].is_object()) {
+                auto &server = mJson["server"];
+                serverBind = server.value("bind", serverBind);
+                serverPort = server.value("port", serverPort);
+                serverMaxConnections = server.value("max-connections", serverMaxConnections);
+                serverMaxBatch = server.value("max-batch", serverMaxBatch);
+                serverBatchDeadlineMs = server.value("batch-deadline-ms", serverBatchDeadlineMs);
+                serverMaxRequestMb = server.value("max-request-mb", serverMaxRequestMb);
+        }
+        LOG(INFO) << "server.bind : " << serverBind;
+        LOG(INFO) << "server.port : " << serverPort;
+        LOG(INFO) << "server.max-connections : " << serverMaxConnections;
+        LOG(INFO) << "server.max-batch : " << serverMaxBatch;
+        LOG(INFO) << "server.batch-deadline-ms : " << serverBatchDeadlineMs;
+        LOG(INFO) << "server.max-request-mb : " << serverMaxRequestMb;
+
+        if (mJson["prefetch"].is_object()) {
+                auto &prefetch = mJson["prefetch"];
+                prefetchEnabled = prefetch.value("enabled", prefetchEnabled);
+                prefetchDepth = prefetch.value("depth", prefetchDepth);
+                prefetchReaders = prefetch.value("readers", prefetchReaders);
+                prefetchMaxBytesMb = prefetch.value("max-bytes-mb", prefetchMaxBytesMb);
+                prefetchBatchSize = prefetch.value("batch-size", prefetchBatchSize);
+                prefetchBatchDeadlineMs = prefetch.value("batch-deadline-ms", prefetchBatchDeadlineMs);
+        }
+        LOG(INFO) << "prefetch.enabled : " << prefetchEnabled;
+        LOG(INFO) << "prefetch.depth : " << prefetchDepth;
+        LOG(INFO) << "prefetch.readers : " << prefetchReaders;
+        LOG(INFO) << "prefetch.max-bytes-mb : " << prefetchMaxBytesMb;
+        LOG(INFO) << "prefetch.batch-size : " << prefetchBatchSize;
+        LOG(INFO) << "prefetch.batch-deadline-ms : " << prefetchBatchDeadlineMs;
+
+        if (mJson["autotune"].is_object()) {
+                auto &autotune = mJson["autotune"];
+                autotuneEnabled = autotune.value("enabled", autotuneEnabled);
+                autotuneIntervalMs = autotune.value("interval-ms", autotuneIntervalMs);
+                autotuneP99TargetMs = autotune.value("p99-target-ms", autotuneP99TargetMs);
+                autotuneMaxReaders = autotune.value("max-readers", autotuneMaxReaders);
+                autotuneMaxBatchSize = autotune.value("max-batch-size", autotuneMaxBatchSize);
+                autotuneMaxBatchDeadlineMs = autotune.value("max-batch-deadline-ms", autotuneMaxBatchDeadlineMs);
+                autotuneMinImprovement = autotune.value("min-improvement", autotuneMinImprovement);
+        }
+        LOG(INFO) << "autotune.enabled : " << autotuneEnabled;
+        LOG(INFO) << "autotune.interval-ms : " << autotuneIntervalMs;
+        LOG(INFO) << "autotune.p99-target-ms : " << autotuneP99TargetMs;
+        LOG(INFO) << "autotune.max-readers : " << autotuneMaxReaders;
+        LOG(INFO) << "autotune.max-batch-size : " << autotuneMaxBatchSize;
+        LOG(INFO) << "autotune.max-batch-deadline-ms : " << autotuneMaxBatchDeadlineMs;
+        LOG(INFO) << "autotune.min-improvement : " << autotuneMinImprovement;
+
 	LOG(INFO) << "----------------------->Config";
-	return true;
+	return valid;
 }
 
 void Config::init() {
@@ -84,6 +313,10 @@ void Config::init() {
 	populateConfigValues();
 }
 
+bool Config::isValid() {
+        return valid;
+}
+
 string &Config::getEsProtocol() {
         return esProtocol;
 }
@@ -99,3 +332,219 @@ uint16_t Config::getEsPort() {
 string &Config::getEsPrefixPath() {
 	return esPrefixPath;
 }
+
+size_t Config::getPublisherMaxInMemory() {
+        return publisherMaxInMemory;
+}
+
+size_t Config::getPublisherMaxInFlight() {
+        return publisherMaxInFlight;
+}
+
+uint32_t Config::getPublisherMaxAttempts() {
+        return publisherMaxAttempts;
+}
+
+uint32_t Config::getPublisherBackoffBaseMs() {
+        return publisherBackoffBaseMs;
+}
+
+uint32_t Config::getPublisherBackoffMaxMs() {
+        return publisherBackoffMaxMs;
+}
+
+uint32_t Config::getPublisherRequestTimeoutMs() {
+        return publisherRequestTimeoutMs;
+}
+
+string &Config::getPublisherSpoolPath() {
+        return publisherSpoolPath;
+}
+
+uint64_t Config::getPublisherSpoolMaxBytes() {
+        return publisherSpoolMaxMb * 1024 * 1024;
+}
+
+int Config::getStatsReportEvery() {
+        return statsReportEvery;
+}
+
+bool Config::getSelfTest() {
+        return selfTest;
+}
+
+void Config::setSelfTest(bool enabled) {
+        selfTest = enabled;
+}
+
+uint64_t Config::getDecodeMemoryBudgetBytes() {
+        return decodeMemoryBudgetMb * 1024 * 1024;
+}
+
+uint64_t Config::getDecodeReduceAboveBytes() {
+        return decodeReduceAboveMb * 1024 * 1024;
+}
+
+uint64_t Config::getDecodeMaxMegapixels() {
+        return decodeMaxMegapixels;
+}
+
+vector<int> &Config::getWarmUpBatchSizes() {
+        return warmUpBatchSizes;
+}
+
+int Config::getShardIndex() {
+        return shardIndex;
+}
+
+int Config::getShardCount() {
+        return shardCount;
+}
+
+string &Config::getShardId() {
+        return shardId;
+}
+
+string &Config::getShardLeaseDir() {
+        return shardLeaseDir;
+}
+
+uint32_t Config::getShardLeaseTtlMs() {
+        return shardLeaseTtlMs;
+}
+
+uint32_t Config::getShardHeartbeatMs() {
+        return shardHeartbeatMs;
+}
+
+bool Config::getTraceEnabled() {
+        return traceEnabled;
+}
+
+uint32_t Config::getTraceSampleEvery() {
+        return traceSampleEvery;
+}
+
+size_t Config::getTraceRingSize() {
+        return traceRingSize;
+}
+
+uint32_t Config::getTraceDumpIntervalMs() {
+        return traceDumpIntervalMs;
+}
+
+string &Config::getTraceDumpDir() {
+        return traceDumpDir;
+}
+
+int Config::getGifFrameStride() {
+        return gifFrameStride;
+}
+
+int Config::getGifMaxFrames() {
+        return gifMaxFrames;
+}
+
+string &Config::getGifAggregate() {
+        return gifAggregate;
+}
+
+bool Config::getMultiCropEnabled() {
+        return multiCropEnabled;
+}
+
+int Config::getMultiCropGrid() {
+        return multiCropGrid;
+}
+
+bool Config::getMultiCropFull() {
+        return multiCropFull;
+}
+
+string &Config::getMultiCropAggregate() {
+        return multiCropAggregate;
+}
+
+bool Config::getArchiveEnabled() {
+        return archiveEnabled;
+}
+
+uint64_t Config::getArchiveMaxMemberBytes() {
+        return archiveMaxMemberMb * 1024 * 1024;
+}
+
+string &Config::getServerBind() {
+        return serverBind;
+}
+
+int Config::getServerPort() {
+        return serverPort;
+}
+
+int Config::getServerMaxConnections() {
+        return serverMaxConnections;
+}
+
+int Config::getServerMaxBatch() {
+        return serverMaxBatch;
+}
+
+int Config::getServerBatchDeadlineMs() {
+        return serverBatchDeadlineMs;
+}
+
+uint64_t Config::getServerMaxRequestBytes() {
+        return serverMaxRequestMb * 1024 * 1024;
+}
+
+bool Config::getPrefetchEnabled() {
+        return prefetchEnabled;
+}
+
+int Config::getPrefetchDepth() {
+        return prefetchDepth;
+}
+
+int Config::getPrefetchReaders() {
+        return prefetchReaders;
+}
+
+uint64_t Config::getPrefetchMaxBytes() {
+        return prefetchMaxBytesMb * 1024 * 1024;
+}
+
+int Config::getPrefetchBatchSize() {
+        return prefetchBatchSize;
+}
+
+int Config::getPrefetchBatchDeadlineMs() {
+        return prefetchBatchDeadlineMs;
+}
+
+bool Config::getAutotuneEnabled() {
+        return autotuneEnabled;
+}
+
+int Config::getAutotuneIntervalMs() {
+        return autotuneIntervalMs;
+}
+
+int Config::getAutotuneP99TargetMs() {
+        return autotuneP99TargetMs;
+}
+
+int Config::getAutotuneMaxReaders() {
+        return autotuneMaxReaders;
+}
+
+int Config::getAutotuneMaxBatchSize() {
+        return autotuneMaxBatchSize;
+}
+
+int Config::getAutotuneMaxBatchDeadlineMs() {
+        return autotuneMaxBatchDeadlineMs;
+}
+
+double Config::getAutotuneMinImprovement() {
+        return autotuneMinImprovement;
+}
@@ -53,14 +53,80 @@ using std::string;
 class Config : public ChCppUtils::Config {
 public:
 	Config();
+	// Reads path instead of the installed or local config file.
+	Config(const string &path);
 	~Config();
 	void init();
+	// False if init() found values that can't work together.
+	bool isValid();
 
         string &getEsProtocol();
         string &getEsHostname();
         uint16_t getEsPort();
         string &getEsPrefixPath();
 
+        size_t getPublisherMaxInMemory();
+        size_t getPublisherMaxInFlight();
+        uint32_t getPublisherMaxAttempts();
+        uint32_t getPublisherBackoffBaseMs();
+        uint32_t getPublisherBackoffMaxMs();
+        uint32_t getPublisherRequestTimeoutMs();
+        string &getPublisherSpoolPath();
+        uint64_t getPublisherSpoolMaxBytes();
+
+        int getStatsReportEvery();
+        bool getSelfTest();
+        // --self_test turns it on over whatever the file says.
+        void setSelfTest(bool enabled);
+
+        uint64_t getDecodeMemoryBudgetBytes();
+        uint64_t getDecodeReduceAboveBytes();
+        uint64_t getDecodeMaxMegapixels();
+
+        vector<int> &getWarmUpBatchSizes();
+
+        int getShardIndex();
+        int getShardCount();
+        string &getShardId();
+        string &getShardLeaseDir();
+        uint32_t getShardLeaseTtlMs();
+        uint32_t getShardHeartbeatMs();
+
+        bool getTraceEnabled();
+        uint32_t getTraceSampleEvery();
+        size_t getTraceRingSize();
+        uint32_t getTraceDumpIntervalMs();
+        string &getTraceDumpDir();
+
+        int getGifFrameStride();
+        int getGifMaxFrames();
+        string &getGifAggregate();
+        bool getMultiCropEnabled();
+        int getMultiCropGrid();
+        bool getMultiCropFull();
+        string &getMultiCropAggregate();
+        bool getArchiveEnabled();
+        uint64_t getArchiveMaxMemberBytes();
+        string &getServerBind();
+        int getServerPort();
+        int getServerMaxConnections();
+        int getServerMaxBatch();
+        int getServerBatchDeadlineMs();
+        uint64_t getServerMaxRequestBytes();
+        bool getPrefetchEnabled();
+        int getPrefetchDepth();
+        int getPrefetchReaders();
+        uint64_t getPrefetchMaxBytes();
+        int getPrefetchBatchSize();
+        int getPrefetchBatchDeadlineMs();
+        bool getAutotuneEnabled();
+        int getAutotuneIntervalMs();
+        int getAutotuneP99TargetMs();
+        int getAutotuneMaxReaders();
+        int getAutotuneMaxBatchSize();
+        int getAutotuneMaxBatchDeadlineMs();
+        double getAutotuneMinImprovement();
+
 private:
 	string etcConfigPath;
 	string localConfigPath;
@@ -71,6 +137,69 @@ private:
         uint16_t esPort;
         string esPrefixPath;
 
+        size_t publisherMaxInMemory;
+        size_t publisherMaxInFlight;
+        uint32_t publisherMaxAttempts;
+        uint32_t publisherBackoffBaseMs;
+        uint32_t publisherBackoffMaxMs;
+        uint32_t publisherRequestTimeoutMs;
+        string publisherSpoolPath;
+        uint64_t publisherSpoolMaxMb;
+
+        int statsReportEvery;
+        bool selfTest;
+
+        uint64_t decodeMemoryBudgetMb;
+        uint64_t decodeReduceAboveMb;
+        uint64_t decodeMaxMegapixels;
+
+        vector<int> warmUpBatchSizes;
+
+        int shardIndex;
+        int shardCount;
+        string shardId;
+        string shardLeaseDir;
+        uint32_t shardLeaseTtlMs;
+        uint32_t shardHeartbeatMs;
+
+        bool traceEnabled;
+        uint32_t traceSampleEvery;
+        size_t traceRingSize;
+        uint32_t traceDumpIntervalMs;
+        string traceDumpDir;
+
+        int gifFrameStride;
+        int gifMaxFrames;
+        string gifAggregate;
+        bool multiCropEnabled;
+        int multiCropGrid;
+        bool multiCropFull;
+        string multiCropAggregate;
+        bool archiveEnabled;
+        uint64_t archiveMaxMemberMb;
+        string serverBind;
+        int serverPort;
+        int serverMaxConnections;
+        int serverMaxBatch;
+        int serverBatchDeadlineMs;
+        uint64_t serverMaxRequestMb;
+        bool prefetchEnabled;
+        int prefetchDepth;
+        int prefetchReaders;
+        uint64_t prefetchMaxBytesMb;
+        int prefetchBatchSize;
+        int prefetchBatchDeadlineMs;
+        bool autotuneEnabled;
+        int autotuneIntervalMs;
+        int autotuneP99TargetMs;
+        int autotuneMaxReaders;
+        int autotuneMaxBatchSize;
+        int autotuneMaxBatchDeadlineMs;
+        double autotuneMinImprovement;
+
+	bool valid;
+
+	Config(const string &etcPath, const string &localPath);
 	bool populateConfigValues();
 };
 
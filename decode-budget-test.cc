@@ -0,0 +1,72 @@
+#include <atomic>
+#include <thread>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "decode-budget.h"
+
+namespace {
+
+TEST(DecodeBudgetTest, AcquireWaitsForRelease) {
+  DecodeBudget budget(100);
+  budget.acquire(60);
+  std::atomic<bool> acquired(false);
+  std::thread waiter([&] {
+    budget.acquire(60);
+    acquired = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(acquired);
+  budget.release(60);
+  EXPECT_TRUE(WaitFor([&] { return acquired.load(); }, 5000));
+  waiter.join();
+  EXPECT_EQ(60u, budget.inUse());
+  EXPECT_EQ(60u, budget.peak());
+  EXPECT_EQ(1u, budget.waits());
+  budget.release(60);
+}
+
+TEST(DecodeBudgetTest, TryAcquireNeverWaits) {
+  DecodeBudget budget(100);
+  EXPECT_TRUE(budget.tryAcquire(70));
+  EXPECT_FALSE(budget.tryAcquire(40));
+  EXPECT_TRUE(budget.tryAcquire(30));
+  EXPECT_EQ(100u, budget.inUse());
+  budget.release(100);
+  EXPECT_EQ(0u, budget.waits());
+}
+
+TEST(DecodeBudgetTest, TakeMayGoOver) {
+  DecodeBudget budget(100);
+  budget.acquire(80);
+  budget.take(80);
+  EXPECT_EQ(160u, budget.inUse());
+  EXPECT_EQ(160u, budget.peak());
+  budget.release(80);
+  budget.release(80);
+  EXPECT_EQ(0u, budget.inUse());
+}
+
+// Many holders at once never reserve more than the budget between them.
+TEST(DecodeBudgetTest, ConcurrentHoldersStayUnderBudget) {
+  DecodeBudget budget(100);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 8; ++i) {
+    workers.emplace_back([&budget, i] {
+      for (int j = 0; j < 200; ++j) {
+        uint64_t bytes = 10 + (i * 7 + j) % 50;
+        budget.acquire(bytes);
+        std::this_thread::yield();
+        budget.release(bytes);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  EXPECT_LE(budget.peak(), 100u);
+  EXPECT_EQ(0u, budget.inUse());
+}
+
+}  // namespace
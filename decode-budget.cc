@@ -0,0 +1,69 @@
+#include "decode-budget.h"
+
+DecodeBudget::DecodeBudget(uint64_t budget) {
+  mBudget = budget;
+  mInUse = 0;
+  mPeak = 0;
+  mWaits = 0;
+}
+
+DecodeBudget::~DecodeBudget() {
+}
+
+// Called with mLock held.
+void DecodeBudget::reserve(uint64_t bytes) {
+  mInUse += bytes;
+  if (mInUse > mPeak) {
+    mPeak = mInUse;
+  }
+}
+
+void DecodeBudget::acquire(uint64_t bytes) {
+  std::unique_lock<std::mutex> lock(mLock);
+  // A reservation alone over the budget only gets here if admission was
+  // skipped; it goes ahead rather than waiting forever.
+  if (mInUse > 0 && mInUse + bytes > mBudget) {
+    mWaits++;
+    mCond.wait(lock, [&] { return mInUse == 0 || mInUse + bytes <= mBudget; });
+  }
+  reserve(bytes);
+}
+
+bool DecodeBudget::tryAcquire(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mLock);
+  if (mInUse > 0 && mInUse + bytes > mBudget) {
+    return false;
+  }
+  reserve(bytes);
+  return true;
+}
+
+void DecodeBudget::take(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mLock);
+  reserve(bytes);
+}
+
+void DecodeBudget::release(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mInUse -= bytes;
+  mCond.notify_all();
+}
+
+uint64_t DecodeBudget::budget() {
+  return mBudget;
+}
+
+uint64_t DecodeBudget::inUse() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mInUse;
+}
+
+uint64_t DecodeBudget::peak() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mPeak;
+}
+
+uint64_t DecodeBudget::waits() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mWaits;
+}
@@ -0,0 +1,41 @@
+#ifndef SRC_DECODE_BUDGET_H_
+#define SRC_DECODE_BUDGET_H_
+
+#include <mutex>
+#include <stdint.h>
+#include <condition_variable>
+
+// Process wide cap on the memory held by images being read and decoded.
+// Callers reserve the probed decode size before reading a file, outside of
+// any lock the decoder holds, and give it back once the decoded tensor is
+// released; reservations that don't fit wait for others to finish. Admission
+// rejects any single image over the whole budget, so every reservation fits
+// once the others are released. take() is for work others are waiting on,
+// such as the oldest prefetched file; it never waits and may briefly go over.
+class DecodeBudget {
+private:
+  std::mutex mLock;
+  std::condition_variable mCond;
+  uint64_t mBudget;
+  uint64_t mInUse;
+  uint64_t mPeak;
+  uint64_t mWaits;
+
+  void reserve(uint64_t bytes);
+public:
+  DecodeBudget(uint64_t budget);
+  ~DecodeBudget();
+
+  void acquire(uint64_t bytes);
+  // Reserves only if it fits right now.
+  bool tryAcquire(uint64_t bytes);
+  void take(uint64_t bytes);
+  void release(uint64_t bytes);
+
+  uint64_t budget();
+  uint64_t inUse();
+  uint64_t peak();
+  uint64_t waits();
+};
+
+#endif /* SRC_DECODE_BUDGET_H_ */
@@ -0,0 +1,212 @@
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "es-publisher.h"
+
+namespace {
+
+// A stand-in for elastic search on a loopback port. While failing it answers
+// every PUT with the configured status after the configured delay; once
+// healthy it answers 200 and remembers the path. Requests can outlive a test,
+// so stubs are never deleted.
+class StubEs {
+ public:
+  StubEs() : failing_(true), status_(503), delayMs_(0), requests_(0) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(listener_, (struct sockaddr *) &address, sizeof(address));
+    listen(listener_, 64);
+    socklen_t length = sizeof(address);
+    getsockname(listener_, (struct sockaddr *) &address, &length);
+    port_ = ntohs(address.sin_port);
+    std::thread(&StubEs::serve, this).detach();
+  }
+
+  void fail(int status, int delayMs) {
+    status_ = status;
+    delayMs_ = delayMs;
+    failing_ = true;
+  }
+  void recover() { failing_ = false; }
+
+  std::string url(int id) {
+    return "http://127.0.0.1:" + std::to_string(port_) + "/test/photo/" +
+      std::to_string(id);
+  }
+  size_t stored() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return stored_.size();
+  }
+  int requests() { return requests_; }
+
+ private:
+  void serve() {
+    while (true) {
+      int fd = accept(listener_, NULL, NULL);
+      if (fd < 0) {
+        return;
+      }
+      std::thread(&StubEs::handle, this, fd).detach();
+    }
+  }
+
+  void handle(int fd) {
+    std::string request;
+    char buffer[4096];
+    size_t end = std::string::npos;
+    while (end == std::string::npos) {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        close(fd);
+        return;
+      }
+      request.append(buffer, n);
+      end = request.find("\r\n\r\n");
+    }
+    size_t length = 0;
+    size_t header = request.find("Content-Length: ");
+    if (header != std::string::npos) {
+      length = strtoul(request.c_str() + header + 16, NULL, 10);
+    }
+    while (request.size() < end + 4 + length) {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n <= 0) {
+        break;
+      }
+      request.append(buffer, n);
+    }
+    requests_++;
+
+    int status = 200;
+    if (failing_) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delayMs_));
+      status = status_;
+    } else {
+      size_t start = request.find(' ') + 1;
+      std::lock_guard<std::mutex> lock(lock_);
+      stored_.insert(request.substr(start, request.find(' ', start) - start));
+    }
+    std::string response = "HTTP/1.1 " + std::to_string(status) +
+      " Stub\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+    close(fd);
+  }
+
+  int listener_;
+  int port_;
+  std::atomic<bool> failing_;
+  std::atomic<int> status_;
+  std::atomic<int> delayMs_;
+  std::atomic<int> requests_;
+  std::mutex lock_;
+  std::set<std::string> stored_;
+};
+
+std::string SpoolPath(const std::string &name) {
+  return tensorflow::testing::TmpDir() + "/" + name + ".spool";
+}
+
+Config *PublisherConfig(const std::string &name, int spoolMaxMb = 1024) {
+  std::string spool = SpoolPath(name);
+  remove(spool.c_str());
+  return LoadTestConfig(name, {
+    {"publisher", {
+      {"max-in-memory", 4},
+      {"max-in-flight", 2},
+      {"max-attempts", 2},
+      {"backoff-base-ms", 10},
+      {"backoff-max-ms", 100},
+      {"request-timeout-ms", 200},
+      {"spool-path", spool},
+      {"spool-max-mb", spoolMaxMb}
+    }}
+  });
+}
+
+// Publishes into a failing server until most documents have been spooled,
+// then lets it recover without publishing anything else.
+void PublishThroughOutage(StubEs *es, Config *config, int documents) {
+  // The dispatcher runs for the life of the process, like in the client, so
+  // the publisher is never deleted.
+  EsPublisher *publisher = new EsPublisher(config);
+  publisher->init();
+  for (int i = 0; i < documents; ++i) {
+    publisher->publish(std::to_string(i), es->url(i), "{\"id\":" +
+                      std::to_string(i) + "}");
+  }
+  // Long enough for every in-memory document to use up its attempts.
+  ASSERT_TRUE(WaitFor([es] { return es->requests() >= 8; }, 5000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  EXPECT_EQ(0, es->stored());
+
+  es->recover();
+  EXPECT_TRUE(WaitFor([es, documents] {
+    return es->stored() == (size_t) documents; }, 10000))
+    << "stored " << es->stored() << " of " << documents;
+}
+
+TEST(EsPublisherTest, SpoolDrainsAfterErrorsStop) {
+  StubEs *es = new StubEs();
+  es->fail(503, 0);
+  PublishThroughOutage(es, PublisherConfig("es-publisher-errors"), 20);
+}
+
+TEST(EsPublisherTest, SpoolDrainsAfterTimeoutsStop) {
+  StubEs *es = new StubEs();
+  // Slower than request-timeout-ms, so every attempt times out.
+  es->fail(200, 400);
+  PublishThroughOutage(es, PublisherConfig("es-publisher-delays"), 20);
+}
+
+TEST(EsPublisherTest, ThrottledRequestsAreRetried) {
+  StubEs *es = new StubEs();
+  es->fail(429, 50);
+  PublishThroughOutage(es, PublisherConfig("es-publisher-throttled"), 6);
+}
+
+TEST(EsPublisherTest, SpoolStopsGrowingAtItsCap) {
+  StubEs *es = new StubEs();
+  es->fail(503, 0);
+  std::string name = "es-publisher-capped";
+  EsPublisher *publisher = new EsPublisher(PublisherConfig(name, 1));
+  publisher->init();
+  // 100 KB documents, 3 MB in all against a 1 MB spool.
+  std::string padding(100 * 1024, 'x');
+  const int documents = 30;
+  for (int i = 0; i < documents; ++i) {
+    publisher->publish(std::to_string(i), es->url(i), "{\"id\":" +
+                       std::to_string(i) + ",\"padding\":\"" + padding + "\"}");
+  }
+  ASSERT_TRUE(WaitFor([es] { return es->requests() >= 8; }, 5000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  struct stat st;
+  ASSERT_EQ(0, stat(SpoolPath(name).c_str(), &st));
+  EXPECT_GT(st.st_size, 0);
+  EXPECT_LE(st.st_size, 1024 * 1024);
+
+  // What fit in the spool still arrives; the rest was dropped.
+  es->recover();
+  EXPECT_TRUE(WaitFor([es] { return es->stored() >= 5; }, 10000))
+    << "stored " << es->stored();
+  std::this_thread::sleep_for(std::chrono::milliseconds(300));
+  EXPECT_LT(es->stored(), (size_t) documents);
+}
+
+}  // namespace
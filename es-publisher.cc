@@ -0,0 +1,345 @@
+#include <glog/logging.h>
+#include <ch-cpp-utils/base64.h>
+
+#include "es-publisher.h"
+
+using ChCppUtils::ThreadJob;
+using ChCppUtils::base64_encode;
+
+EsPublisher::EsPublisher(Config *config) {
+  this->config = config;
+  mDispatchPool = NULL;
+  mSequence = 0;
+  mConsecutiveFailures = 0;
+  mNextProbe = Clock::now();
+  mRandom.seed(std::random_device()());
+  mSpoolPath = config->getPublisherSpoolPath();
+  mSpoolWritten = 0;
+  mSpoolRead = 0;
+  mSpoolFull = false;
+  mPublished = 0;
+  mRetried = 0;
+  mSpooled = 0;
+  mReplayed = 0;
+  mDropped = 0;
+
+  std::string user = "elastic:changeme";
+  authorization = "Basic ";
+  authorization += base64_encode((unsigned char *) user.data(), user.length());
+}
+
+EsPublisher::~EsPublisher() {
+}
+
+void EsPublisher::init() {
+  // Anything left over in the spool from a previous run gets replayed.
+  std::ifstream existing(mSpoolPath, std::ios::binary | std::ios::ate);
+  if (existing) {
+    mSpoolWritten = existing.tellg();
+  }
+  mSpoolWriter.open(mSpoolPath, std::ios::binary | std::ios::app);
+  if (!mSpoolWriter) {
+    LOG(ERROR) << "Unable to open spool file: " << mSpoolPath;
+  }
+  LOG(INFO) << "Publisher spool: " << mSpoolPath << " (" << mSpoolWritten <<
+    " bytes pending)";
+
+  mLastReport = Clock::now();
+  mDispatchPool = new ThreadPool (1, false);
+  ThreadJob *job = new ThreadJob (EsPublisher::_dispatchRoutine, this);
+  mDispatchPool->addJob(job);
+}
+
+void EsPublisher::publish(const std::string &image, const std::string &url,
+                          const std::string &body) {
+  Document document = {image, url, body, 0, Trace::now()};
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (inMemory() < config->getPublisherMaxInMemory()) {
+      mPending.emplace(Clock::now(), document);
+      mCond.notify_one();
+      return;
+    }
+  }
+  spool(document);
+}
+
+// Called with mLock held.
+size_t EsPublisher::inMemory() {
+  return mPending.size() + mInFlight.size();
+}
+
+// Full jitter on the upper half of the window, so a burst of failures does not
+// come back as a burst of retries.
+EsPublisher::Clock::duration EsPublisher::backoff(uint32_t attempts) {
+  uint64_t base = config->getPublisherBackoffBaseMs();
+  uint64_t max = config->getPublisherBackoffMaxMs();
+  uint64_t delay = base << std::min<uint32_t>(attempts, 20);
+  if (delay > max) {
+    delay = max;
+  }
+  std::uniform_int_distribution<uint64_t> jitter(delay / 2, delay);
+  return std::chrono::milliseconds(jitter(mRandom));
+}
+
+// Called without mLock, so a slow disk never holds up publish().
+void EsPublisher::spool(const Document &document) {
+  std::lock_guard<std::mutex> lock(mSpoolLock);
+  if (!mSpoolWriter) {
+    LOG(ERROR) << "Spool unavailable, dropping " << document.url;
+    mDropped++;
+    return;
+  }
+  // The file is only truncated once all of it has been replayed, so its size
+  // is what's capped, not the part still waiting.
+  uint64_t record = document.url.length() + document.body.length() + 2;
+  if (mSpoolWritten + record > config->getPublisherSpoolMaxBytes()) {
+    if (!mSpoolFull) {
+      LOG(ERROR) << "Spool full at " << mSpoolWritten << " bytes, dropping " <<
+        "documents until it is replayed: " << mSpoolPath;
+      mSpoolFull = true;
+    }
+    mDropped++;
+    return;
+  }
+  // Bodies are single line json dumps, so one record per line is enough.
+  mSpoolWriter << document.url << '\t' << document.body << '\n';
+  mSpoolWriter.flush();
+  mSpoolWritten += record;
+  mSpooled++;
+}
+
+// Spools the documents retry() gave up on while mLock was held.
+void EsPublisher::spoolOverflow() {
+  std::vector<Document> overflow;
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    overflow.swap(mOverflow);
+  }
+  for (auto &document : overflow) {
+    spool(document);
+  }
+}
+
+// Replays while elastic search is answering and the in-memory queue has
+// drained below half of its limit. While it is failing, a single record is
+// let through every backoff period instead, and only when nothing else is
+// pending to find out whether it has recovered; its success resets the
+// failure count and lets the rest follow.
+void EsPublisher::replaySpool() {
+  {
+    std::lock_guard<std::mutex> lock(mSpoolLock);
+    if (mSpoolRead >= mSpoolWritten) {
+      return;
+    }
+  }
+  size_t limit = config->getPublisherMaxInMemory() / 2;
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mConsecutiveFailures > 0) {
+      Clock::time_point now = Clock::now();
+      if (!mPending.empty() || !mInFlight.empty() || now < mNextProbe) {
+        return;
+      }
+      mNextProbe = now + backoff(mConsecutiveFailures);
+      limit = 1;
+    } else if (inMemory() >= limit) {
+      return;
+    } else {
+      limit -= inMemory();
+    }
+  }
+
+  std::vector<Document> replayed;
+  {
+    std::lock_guard<std::mutex> lock(mSpoolLock);
+    std::ifstream reader(mSpoolPath, std::ios::binary);
+    reader.seekg(mSpoolRead);
+    std::string line;
+    while (replayed.size() < limit && mSpoolRead < mSpoolWritten &&
+           std::getline(reader, line)) {
+      mSpoolRead += line.length() + 1;
+      size_t tab = line.find('\t');
+      if (tab == std::string::npos) {
+        LOG(ERROR) << "Skipping corrupt spool record at offset " << mSpoolRead;
+        continue;
+      }
+      Document document = {"", line.substr(0, tab), line.substr(tab + 1), 0, 0};
+      replayed.push_back(document);
+    }
+
+    if (mSpoolRead >= mSpoolWritten) {
+      LOG(INFO) << "Spool replayed, truncating " << mSpoolPath;
+      if (mSpoolFull) {
+        LOG(INFO) << "Spooling again, " << mDropped << " documents dropped so far";
+        mSpoolFull = false;
+      }
+      mSpoolWriter.close();
+      mSpoolWriter.open(mSpoolPath, std::ios::binary | std::ios::trunc);
+      mSpoolWritten = 0;
+      mSpoolRead = 0;
+    }
+  }
+  if (replayed.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mLock);
+  for (auto &document : replayed) {
+    mPending.emplace(Clock::now(), document);
+    mReplayed++;
+  }
+}
+
+// Called with mLock held.
+void EsPublisher::retry(Document &document) {
+  document.attempts++;
+  if (document.attempts >= config->getPublisherMaxAttempts()) {
+    // Stop holding memory for a document elastic search keeps refusing; it
+    // comes back through the spool once things recover. The dispatcher
+    // writes it out once mLock is released.
+    mOverflow.push_back(document);
+    mCond.notify_one();
+    return;
+  }
+  mRetried++;
+  document.queuedUs = Trace::now();
+  mPending.emplace(Clock::now() + backoff(document.attempts), document);
+}
+
+// Called with mLock held. Requests that never completed are treated as
+// failures, otherwise a stalled elastic search would pin every slot.
+void EsPublisher::expireInFlight() {
+  Clock::time_point now = Clock::now();
+  for (auto it = mInFlight.begin(); it != mInFlight.end();) {
+    if (it->second.deadline > now) {
+      ++it;
+      continue;
+    }
+    LOG(WARNING) << "Request timed out: " << it->second.document.url;
+    mConsecutiveFailures++;
+    retry(it->second.document);
+    it = mInFlight.erase(it);
+  }
+}
+
+void EsPublisher::report() {
+  uint64_t spooled_bytes = 0;
+  {
+    std::lock_guard<std::mutex> lock(mSpoolLock);
+    spooled_bytes = mSpoolWritten - mSpoolRead;
+  }
+  std::lock_guard<std::mutex> lock(mLock);
+  Clock::time_point now = Clock::now();
+  if (now - mLastReport < std::chrono::seconds(10)) {
+    return;
+  }
+  mLastReport = now;
+  LOG(INFO) << "Publisher: published " << mPublished << ", retried " <<
+    mRetried << ", spooled " << mSpooled << ", replayed " << mReplayed <<
+    ", dropped " << mDropped << ", pending " << mPending.size() <<
+    ", in flight " << mInFlight.size() << ", spool bytes " << spooled_bytes;
+}
+
+void * EsPublisher::_dispatchRoutine (void *arg, struct event_base *base) {
+  EsPublisher *publisher = (EsPublisher *) arg;
+  return publisher->dispatchRoutine();
+}
+
+void *EsPublisher::dispatchRoutine () {
+  std::chrono::milliseconds tick(100);
+  while (true) {
+    // The spool is driven from here on every tick, not from publish(), so it
+    // keeps draining when no new documents arrive.
+    spoolOverflow();
+    replaySpool();
+    report();
+
+    uint64_t sequence = 0;
+    Document document;
+    {
+      std::unique_lock<std::mutex> lock(mLock);
+      expireInFlight();
+      if (!mOverflow.empty()) {
+        continue;
+      }
+
+      Clock::time_point wakeup = Clock::now() + tick;
+      if (!mPending.empty() && mPending.begin()->first < wakeup) {
+        wakeup = mPending.begin()->first;
+      }
+      if (mPending.empty() || mPending.begin()->first > Clock::now() ||
+          mInFlight.size() >= config->getPublisherMaxInFlight()) {
+        mCond.wait_until(lock, wakeup);
+        continue;
+      }
+
+      document = mPending.begin()->second;
+      mPending.erase(mPending.begin());
+      sequence = ++mSequence;
+      int64_t sent = Trace::now();
+      Trace::record("publish-queue", document.image, document.queuedUs, sent);
+      InFlight inFlight = {document, Clock::now() +
+        std::chrono::milliseconds(config->getPublisherRequestTimeoutMs()),
+        sent};
+      mInFlight.emplace(sequence, inFlight);
+    }
+    send(sequence, document);
+  }
+  return NULL;
+}
+
+void EsPublisher::send(uint64_t sequence, const Document &document) {
+  RequestContext *context = new RequestContext();
+  context->publisher = this;
+  context->sequence = sequence;
+
+  HttpRequest *httpRequest = new HttpRequest();
+  httpRequest->onLoad(EsPublisher::_onLoad).bind(context);
+  httpRequest->open(EVHTTP_REQ_PUT, document.url)
+    .setHeader("Authorization", authorization)
+    .setHeader("Content-Type", "application/json; charset=UTF-8")
+    .send((void *) document.body.data(), document.body.length());
+}
+
+void EsPublisher::_onLoad(HttpRequestLoadEvent *event, void *this_) {
+  RequestContext *context = (RequestContext *) this_;
+  context->publisher->onLoad(context->sequence, event);
+  delete context;
+}
+
+void EsPublisher::onLoad(uint64_t sequence, HttpRequestLoadEvent *event) {
+  HttpResponse *response = event->getResponse();
+  int code = response->getResponseCode();
+
+  std::lock_guard<std::mutex> lock(mLock);
+  auto it = mInFlight.find(sequence);
+  if (it == mInFlight.end()) {
+    // Already timed out and rescheduled.
+    return;
+  }
+  Document document = it->second.document;
+  Trace::record("es-request", document.image, it->second.sentUs, Trace::now());
+  mInFlight.erase(it);
+  mCond.notify_one();
+
+  if (code >= 200 && code < 300) {
+    mConsecutiveFailures = 0;
+    mPublished++;
+    return;
+  }
+
+  if (code == 408 || code == 429 || code >= 500 || code <= 0) {
+    mConsecutiveFailures++;
+    LOG(WARNING) << "Publish failed (" << code << "), attempt " <<
+      (document.attempts + 1) << ": " << document.url;
+    retry(document);
+    return;
+  }
+
+  // Anything else is a problem with the document itself; retrying won't help.
+  mConsecutiveFailures = 0;
+  mDropped++;
+  LOG(ERROR) << "Publish rejected: " << code << " " <<
+    response->getResponseText() << ": " << document.url;
+}
@@ -0,0 +1,115 @@
+#ifndef SRC_ES_PUBLISHER_H_
+#define SRC_ES_PUBLISHER_H_
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <condition_variable>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+#include <ch-cpp-utils/http-client.hpp>
+#include <ch-cpp-utils/http-request.hpp>
+
+#include "config.h"
+#include "trace.h"
+
+using ChCppUtils::ThreadPool;
+
+using ChCppUtils::Http::Client::HttpRequest;
+using ChCppUtils::Http::Client::HttpResponse;
+using ChCppUtils::Http::Client::HttpRequestLoadEvent;
+
+// Publishes label documents to elastic search without ever blocking the
+// caller. Documents are queued in memory and sent by a single dispatcher with
+// a bounded number of requests in flight. Failed, throttled (429) or timed out
+// requests are retried with exponential backoff and jitter. Once the in-memory
+// limit is reached documents are appended to a spool file, which is replayed
+// when elastic search is healthy again. While it is failing, one spooled
+// document at a time goes out as a health probe, once per backoff period, so
+// the spool drains after an outage even if nothing new is published. The spool
+// file is only touched outside the lock publish() takes. It stops growing at
+// "publisher.spool-max-mb"; documents beyond that are dropped until it has
+// been replayed. Documents are PUT by
+// id, so a replay that overlaps an earlier successful attempt is harmless.
+class EsPublisher {
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Document {
+    std::string image;
+    std::string url;
+    std::string body;
+    uint32_t attempts;
+    int64_t queuedUs;
+  };
+
+  struct InFlight {
+    Document document;
+    Clock::time_point deadline;
+    int64_t sentUs;
+  };
+
+  struct RequestContext {
+    EsPublisher *publisher;
+    uint64_t sequence;
+  };
+
+  Config *config;
+  std::string authorization;
+  ThreadPool *mDispatchPool;
+
+  std::mutex mLock;
+  std::condition_variable mCond;
+  std::multimap<Clock::time_point, Document> mPending;
+  std::map<uint64_t, InFlight> mInFlight;
+  std::vector<Document> mOverflow;
+  uint64_t mSequence;
+  uint32_t mConsecutiveFailures;
+  Clock::time_point mNextProbe;
+  std::mt19937 mRandom;
+
+  // Everything about the spool file is under mSpoolLock, never mLock.
+  std::mutex mSpoolLock;
+  std::string mSpoolPath;
+  std::ofstream mSpoolWriter;
+  uint64_t mSpoolWritten;
+  uint64_t mSpoolRead;
+  bool mSpoolFull;
+
+  std::atomic<uint64_t> mPublished;
+  std::atomic<uint64_t> mRetried;
+  std::atomic<uint64_t> mSpooled;
+  std::atomic<uint64_t> mReplayed;
+  std::atomic<uint64_t> mDropped;
+  Clock::time_point mLastReport;
+
+  static void *_dispatchRoutine (void *arg, struct event_base *base);
+  void *dispatchRoutine ();
+
+  static void _onLoad(HttpRequestLoadEvent *event, void *this_);
+  void onLoad(uint64_t sequence, HttpRequestLoadEvent *event);
+
+  void send(uint64_t sequence, const Document &document);
+  void retry(Document &document);
+  void expireInFlight();
+  void spool(const Document &document);
+  void spoolOverflow();
+  void replaySpool();
+  void report();
+  Clock::duration backoff(uint32_t attempts);
+  size_t inMemory();
+public:
+  EsPublisher(Config *config);
+  ~EsPublisher();
+  void init();
+  void publish(const std::string &image, const std::string &url,
+        const std::string &body);
+};
+
+#endif /* SRC_ES_PUBLISHER_H_ */
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Runs the golden corpus the way CI does, against a scratch copy so the
+# checked in golden file is never rewritten.
+set -u
+
+BINARY=tensorflow/examples/ch-tf-label-image-client/ch-tf-label-image-client
+GOLDEN=tensorflow/examples/ch-tf-label-image-client/golden/golden.json
+WORK="${TEST_TMPDIR:-/tmp}/golden-corpus"
+rm -rf "$WORK"
+mkdir -p "$WORK"
+cp "$GOLDEN" "$WORK/golden.json"
+
+# Without a baseline for this machine the check has to fail, not write one.
+if "$BINARY" --golden="$WORK/golden.json"; then
+  echo "FAIL: passed without a baseline"
+  exit 1
+fi
+if ls "$WORK"/baseline-*.json > /dev/null 2>&1; then
+  echo "FAIL: wrote a baseline without --golden_baseline"
+  exit 1
+fi
+
+# Only this machine's baseline is recorded; the labels of both runs are
+# checked against the ones checked in, which must be left as they are.
+if ! "$BINARY" --golden="$WORK/golden.json" --golden_baseline; then
+  echo "FAIL: recording the baseline"
+  exit 1
+fi
+if ! cmp -s "$GOLDEN" "$WORK/golden.json"; then
+  echo "FAIL: golden labels were rewritten"
+  exit 1
+fi
+if ! "$BINARY" --golden="$WORK/golden.json"; then
+  echo "FAIL: check against the golden labels and baseline"
+  exit 1
+fi
+echo "PASS"
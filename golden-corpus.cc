@@ -0,0 +1,292 @@
+#include <map>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <unistd.h>
+#include <glog/logging.h>
+
+#include "golden-corpus.h"
+
+GoldenCorpus::GoldenCorpus(Config *config, std::string goldenPath, bool record,
+                           bool recordBaseline) {
+  this->config = config;
+  this->goldenPath = goldenPath;
+  this->record = record;
+  this->recordBaseline = record || recordBaseline;
+  decodeBudget = NULL;
+  labelImage = NULL;
+}
+
+GoldenCorpus::~GoldenCorpus() {
+  delete labelImage;
+  delete decodeBudget;
+}
+
+void GoldenCorpus::_onLabel (std::string image, std::vector<std::string> labels, std::vector<float> scores, void *this_) {
+  GoldenCorpus *corpus = (GoldenCorpus *) this_;
+  corpus->onLabel(image, labels, scores);
+}
+
+void GoldenCorpus::onLabel (std::string image, std::vector<std::string> labels, std::vector<float> scores) {
+  last.labels = labels;
+  last.scores = scores;
+}
+
+std::string GoldenCorpus::baselinePath() {
+  char hostname[256] = {0};
+  gethostname(hostname, sizeof(hostname) - 1);
+  std::string dir = ".";
+  size_t slash = goldenPath.find_last_of('/');
+  if (slash != std::string::npos) {
+    dir = goldenPath.substr(0, slash);
+  }
+  return dir + "/baseline-" + hostname + ".json";
+}
+
+int GoldenCorpus::run() {
+  std::ifstream file(goldenPath);
+  if (!file) {
+    LOG(ERROR) << "Golden file not found: " << goldenPath;
+    return -1;
+  }
+  json golden = json::parse(file);
+
+  decodeBudget = new DecodeBudget(config->getDecodeMemoryBudgetBytes());
+  labelImage = new LabelImage(config, decodeBudget);
+  if (labelImage->init(GoldenCorpus::_onLabel, this) != 0 ||
+      labelImage->warmUp(config->getWarmUpBatchSizes()) != 0) {
+    LOG(ERROR) << "Unable to initialize the model";
+    return -1;
+  }
+
+  labelImage->setMultiCrop(false);
+  std::vector<json> recorded;
+  bool labels_ok = checkLabels(golden, &recorded);
+  if (record) {
+    // What was just recorded is the golden set from here on.
+    golden["images"] = recorded;
+  }
+
+  // Images that are meant to be rejected would only flatter the timing.
+  std::vector<std::string> images;
+  for (auto &entry : golden["images"]) {
+    if (!entry.value("rejected", false)) {
+      images.push_back(entry["path"].get<std::string>());
+    }
+  }
+  bool throughput_ok = checkThroughput(golden, images);
+  if (config->getMultiCropEnabled()) {
+    compareMultiCrop(golden, images);
+  }
+
+  if (record) {
+    std::ofstream out(goldenPath, std::ios::trunc);
+    out << golden.dump(4) << '\n';
+    LOG(INFO) << "Recorded golden labels to " << goldenPath;
+    // Ground truth and rejections are still checked while recording.
+    return labels_ok ? 0 : -1;
+  }
+
+  if (!labels_ok || !throughput_ok) {
+    LOG(ERROR) << "Golden corpus FAILED";
+    return -1;
+  }
+  LOG(INFO) << "Golden corpus passed";
+  return 0;
+}
+
+bool GoldenCorpus::checkLabels(json &golden, std::vector<json> *recorded) {
+  float tolerance = golden.value("score-tolerance", 0.02f);
+  bool ok = true;
+
+  for (auto &entry : golden["images"]) {
+    std::string path = entry["path"].get<std::string>();
+    last = Result();
+    bool labeled = labelImage->process(path) == 0 && !last.labels.empty();
+    if (entry.value("rejected", false)) {
+      if (labeled) {
+        LOG(ERROR) << path << ": labeled '" << last.labels[0] <<
+          "', expected it to be rejected";
+        ok = false;
+      }
+      recorded->push_back(entry);
+      continue;
+    }
+    if (!labeled) {
+      LOG(ERROR) << path << ": not labeled";
+      ok = false;
+      recorded->push_back(entry);
+      continue;
+    }
+    // The ground truth holds whatever was recorded.
+    if (entry.count("expected") != 0 &&
+        entry["expected"].get<std::string>() != last.labels[0]) {
+      LOG(ERROR) << path << ": top-1 is '" << last.labels[0] <<
+        "', ground truth '" << entry["expected"].get<std::string>() << "'";
+      ok = false;
+    }
+
+    json labels = json::array();
+    for (size_t pos = 0; pos < last.labels.size(); ++pos) {
+      json label;
+      label["label"] = last.labels[pos];
+      label["score"] = last.scores[pos];
+      labels.push_back(label);
+    }
+    json updated = entry;
+    updated["labels"] = labels;
+    recorded->push_back(updated);
+    if (record) {
+      continue;
+    }
+
+    if (entry.count("labels") == 0 || entry["labels"].size() == 0) {
+      LOG(WARNING) << path << ": no golden labels recorded, only checked " <<
+        "that it is labeled";
+      continue;
+    }
+    auto &expected = entry["labels"];
+    if (expected[0]["label"].get<std::string>() != last.labels[0]) {
+      LOG(ERROR) << path << ": top-1 is '" << last.labels[0] <<
+        "', expected '" << expected[0]["label"].get<std::string>() << "'";
+      ok = false;
+    }
+    for (auto &label : expected) {
+      std::string name = label["label"].get<std::string>();
+      float score = label["score"].get<float>();
+      auto found = std::find(last.labels.begin(), last.labels.end(), name);
+      if (found == last.labels.end()) {
+        if (score > tolerance) {
+          LOG(ERROR) << path << ": '" << name << "' (" << score <<
+            ") dropped out of the top " << last.labels.size();
+          ok = false;
+        }
+        continue;
+      }
+      float actual = last.scores[found - last.labels.begin()];
+      if (std::fabs(actual - score) > tolerance) {
+        LOG(ERROR) << path << ": '" << name << "' scored " << actual <<
+          ", expected " << score << " +/- " << tolerance;
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+bool GoldenCorpus::checkThroughput(json &golden, const std::vector<std::string> &images) {
+  typedef std::chrono::steady_clock Clock;
+  int iterations = golden.value("iterations", 10);
+  std::vector<double> latencies;
+
+  Clock::time_point start = Clock::now();
+  for (int iteration = 0; iteration < iterations; ++iteration) {
+    for (auto &image : images) {
+      Clock::time_point begin = Clock::now();
+      labelImage->process(image);
+      latencies.push_back(std::chrono::duration<double, std::milli>(
+          Clock::now() - begin).count());
+    }
+  }
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  if (latencies.empty() || seconds <= 0) {
+    return true;
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  size_t index = (size_t) std::ceil(0.99 * latencies.size()) - 1;
+  double p99 = latencies[std::min(index, latencies.size() - 1)];
+  double rate = latencies.size() / seconds;
+  LOG(INFO) << "Golden corpus: " << rate << " images/sec, p99 " << p99 <<
+    " ms over " << latencies.size() << " runs";
+
+  std::string path = baselinePath();
+  std::ifstream file(path);
+  if (!recordBaseline && !file) {
+    LOG(ERROR) << "No baseline for this machine at " << path <<
+      "; run once with --golden_baseline to create it";
+    return false;
+  }
+  if (recordBaseline) {
+    json baseline;
+    baseline["images-per-sec"] = rate;
+    baseline["p99-ms"] = p99;
+    std::ofstream out(path, std::ios::trunc);
+    out << baseline.dump(4) << '\n';
+    LOG(INFO) << "Recorded baseline to " << path;
+    return true;
+  }
+
+  json baseline = json::parse(file);
+  double min_rate = baseline["images-per-sec"].get<double>() *
+    (1.0 - golden.value("throughput-tolerance", 0.2));
+  double max_p99 = baseline["p99-ms"].get<double>() *
+    (1.0 + golden.value("latency-tolerance", 0.3));
+  bool ok = true;
+  if (rate < min_rate) {
+    LOG(ERROR) << "Throughput " << rate << " images/sec below " << min_rate;
+    ok = false;
+  }
+  if (p99 > max_p99) {
+    LOG(ERROR) << "p99 " << p99 << " ms above " << max_p99 << " ms";
+    ok = false;
+  }
+  return ok;
+}
+
+void GoldenCorpus::compareMultiCrop(json &golden, const std::vector<std::string> &images) {
+  typedef std::chrono::steady_clock Clock;
+  int iterations = golden.value("iterations", 10);
+  double rates[2] = {0, 0};
+  size_t correct[2] = {0, 0};
+  size_t scored = 0;
+  const char *modes[2] = {"single-crop", "multi-crop"};
+
+  // Only ground truth is scored. A recorded label came from single-crop, so
+  // scoring against it would favor that mode.
+  std::map<std::string, std::string> truth;
+  for (auto &entry : golden["images"]) {
+    if (entry.count("expected") != 0) {
+      truth[entry["path"].get<std::string>()] =
+        entry["expected"].get<std::string>();
+    }
+  }
+
+  for (int mode = 0; mode < 2; ++mode) {
+    labelImage->setMultiCrop(mode == 1);
+    for (auto &image : images) {
+      auto expected = truth.find(image);
+      if (expected == truth.end()) {
+        continue;
+      }
+      if (mode == 0) {
+        scored++;
+      }
+      last = Result();
+      labelImage->process(image);
+      if (!last.labels.empty() && last.labels[0] == expected->second) {
+        correct[mode]++;
+      } else {
+        LOG(INFO) << image << ": " << modes[mode] << " top-1 '" <<
+          (last.labels.empty() ? "" : last.labels[0]) << "', ground truth '" <<
+          expected->second << "'";
+      }
+    }
+    Clock::time_point start = Clock::now();
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+      for (auto &image : images) {
+        labelImage->process(image);
+      }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    rates[mode] = seconds > 0 ? images.size() * iterations / seconds : 0;
+  }
+  labelImage->setMultiCrop(false);
+
+  LOG(INFO) << "Single-crop " << rates[0] << " images/sec, top-1 " <<
+    correct[0] << "/" << scored << "; multi-crop " << rates[1] <<
+    " images/sec, top-1 " << correct[1] << "/" << scored << " (grid " <<
+    config->getMultiCropGrid() << "); " << scored << " of " <<
+    images.size() << " images have ground truth";
+}
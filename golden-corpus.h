@@ -0,0 +1,62 @@
+#ifndef SRC_GOLDEN_CORPUS_H_
+#define SRC_GOLDEN_CORPUS_H_
+
+#include <string>
+#include <vector>
+#include <ch-cpp-utils/third-party/json/json.hpp>
+
+#include "config.h"
+#include "label-image.h"
+#include "decode-budget.h"
+
+using json = nlohmann::json;
+
+// Runs a small corpus through the full LabelImage path and checks it against
+// stored golden labels and a stored per-machine throughput baseline.
+//
+// The golden file lists images with their recorded top labels and scores,
+// and optionally an "expected" ground truth top-1 that recording never
+// changes, or "rejected" for images that must not be labeled. Top-1 must
+// match exactly; every recorded top-5 label scoring above the tolerance must
+// still be in the top 5 with its score within the tolerance. Timing runs the
+// corpus "iterations" times and compares images/sec and p99 latency against
+// baseline-<hostname>.json next to the golden file. A missing baseline is a
+// failure; --golden_baseline writes it while still checking the labels, and
+// --golden_record writes it and rewrites the recorded labels. Images with no
+// recorded labels yet only have to be labeled until they are recorded.
+//
+// The checks always run single-crop so golden labels stay comparable. With
+// "multi-crop.enabled" set the corpus is then timed in both modes, and each
+// mode's images/sec and top-1 accuracy against the "expected" ground truth
+// logged, along with how many images had any.
+class GoldenCorpus {
+private:
+  struct Result {
+    std::vector<std::string> labels;
+    std::vector<float> scores;
+  };
+
+  Config *config;
+  std::string goldenPath;
+  bool record;
+  bool recordBaseline;
+  DecodeBudget *decodeBudget;
+  LabelImage *labelImage;
+  Result last;
+
+  static void _onLabel (std::string image, std::vector<std::string> labels, std::vector<float> scores, void *this_);
+  void onLabel (std::string image, std::vector<std::string> labels, std::vector<float> scores);
+
+  bool checkLabels(json &golden, std::vector<json> *recorded);
+  bool checkThroughput(json &golden, const std::vector<std::string> &images);
+  void compareMultiCrop(json &golden, const std::vector<std::string> &images);
+  std::string baselinePath();
+public:
+  GoldenCorpus(Config *config, std::string goldenPath, bool record,
+               bool recordBaseline);
+  ~GoldenCorpus();
+  // Returns 0 when everything is within tolerance.
+  int run();
+};
+
+#endif /* SRC_GOLDEN_CORPUS_H_ */
@@ -0,0 +1,52 @@
+#include <string>
+
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "image-probe.h"
+
+namespace {
+
+TEST(ImageProbeTest, CountsGifFrames) {
+  std::string gif = TestGif(32, 16, 3);
+  ImageInfo info;
+  TF_ASSERT_OK(ImageProbe::probeBuffer(gif, &info));
+  EXPECT_EQ(IMAGE_FORMAT_GIF, info.format);
+  EXPECT_EQ(32u, info.width);
+  EXPECT_EQ(16u, info.height);
+  EXPECT_EQ(3u, info.frames);
+  EXPECT_EQ(3u, info.framesCounted);
+}
+
+// A long animation is only walked part way; the rest of the frames are
+// estimated from the file size, never past the real count.
+TEST(ImageProbeTest, EstimatesFramesOfLongGifs) {
+  for (int frames : {1100, 1500, 4000, 4001, 9999}) {
+    std::string gif = TestGif(32, 16, frames);
+    ImageInfo info;
+    TF_ASSERT_OK(ImageProbe::probeBuffer(gif, &info));
+    EXPECT_GE(info.frames, (uint32_t) frames * 95 / 100) << frames;
+    EXPECT_LE(info.frames, (uint32_t) frames) << frames;
+    EXPECT_GT(info.framesCounted, 0u) << frames;
+    EXPECT_LT(info.framesCounted, (uint32_t) frames) << frames;
+    EXPECT_LE(info.framesCounted, info.frames) << frames;
+  }
+}
+
+TEST(ImageProbeTest, RejectsTruncatedGif) {
+  std::string gif = TestGif(32, 16, 3);
+  ImageInfo info;
+  tensorflow::Status status = ImageProbe::probeBuffer(
+      tensorflow::StringPiece(gif.data(), 20), &info);
+  EXPECT_TRUE(tensorflow::errors::IsDataLoss(status)) << status;
+}
+
+TEST(ImageProbeTest, RejectsUnknownFormats) {
+  ImageInfo info;
+  tensorflow::Status status = ImageProbe::probeBuffer("not an image at all", &info);
+  EXPECT_TRUE(tensorflow::errors::IsUnimplemented(status)) << status;
+}
+
+}  // namespace
@@ -0,0 +1,310 @@
+#include "tensorflow/core/lib/core/errors.h"
+#include "tensorflow/core/lib/strings/strcat.h"
+
+#include "image-probe.h"
+
+using tensorflow::Status;
+using tensorflow::StringPiece;
+using tensorflow::uint8;
+using tensorflow::uint32;
+using tensorflow::uint64;
+
+// Random access to the encoded bytes, a small window at a time.
+class ImageProbe::Source {
+public:
+  virtual ~Source() {}
+  virtual uint64 size() = 0;
+  // Points *out at n bytes starting at offset, or fails if there aren't that
+  // many.
+  virtual Status bytes(uint64 offset, size_t n, const uint8 **out) = 0;
+};
+
+class ImageProbe::FileSource : public ImageProbe::Source {
+private:
+  static const size_t kWindow = 64 * 1024;
+  std::unique_ptr<tensorflow::RandomAccessFile> file;
+  uint64 fileSize;
+  tensorflow::string window;
+  uint64 windowOffset;
+  size_t windowLength;
+public:
+  FileSource(std::unique_ptr<tensorflow::RandomAccessFile> file, uint64 size) :
+      file(std::move(file)), fileSize(size), windowOffset(0), windowLength(0) {
+    window.resize(kWindow);
+  }
+
+  uint64 size() override {
+    return fileSize;
+  }
+
+  Status bytes(uint64 offset, size_t n, const uint8 **out) override {
+    if (offset + n > fileSize) {
+      return tensorflow::errors::DataLoss("Unexpected end of file at ", offset);
+    }
+    if (offset < windowOffset || offset + n > windowOffset + windowLength) {
+      StringPiece result;
+      Status status = file->Read(offset, kWindow, &result, &window[0]);
+      if (!status.ok() && !tensorflow::errors::IsOutOfRange(status)) {
+        return status;
+      }
+      if (result.data() != window.data()) {
+        memmove(&window[0], result.data(), result.size());
+      }
+      windowOffset = offset;
+      windowLength = result.size();
+      if (n > windowLength) {
+        return tensorflow::errors::DataLoss("Short read at ", offset);
+      }
+    }
+    *out = (const uint8 *) window.data() + (offset - windowOffset);
+    return Status::OK();
+  }
+};
+
+class ImageProbe::MemorySource : public ImageProbe::Source {
+private:
+  StringPiece data;
+public:
+  MemorySource(StringPiece data) : data(data) {}
+
+  uint64 size() override {
+    return data.size();
+  }
+
+  Status bytes(uint64 offset, size_t n, const uint8 **out) override {
+    if (offset + n > data.size()) {
+      return tensorflow::errors::DataLoss("Unexpected end of data at ", offset);
+    }
+    *out = (const uint8 *) data.data() + offset;
+    return Status::OK();
+  }
+};
+
+static uint32 BigEndian16(const uint8 *p) {
+  return (p[0] << 8) | p[1];
+}
+
+static uint32 BigEndian32(const uint8 *p) {
+  return ((uint32) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32 LittleEndian16(const uint8 *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32 LittleEndian32(const uint8 *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24);
+}
+
+Status ImageProbe::probeFile(tensorflow::Env *env,
+                             const tensorflow::string &filename,
+                             ImageInfo *info) {
+  uint64 file_size = 0;
+  TF_RETURN_IF_ERROR(env->GetFileSize(filename, &file_size));
+  std::unique_ptr<tensorflow::RandomAccessFile> file;
+  TF_RETURN_IF_ERROR(env->NewRandomAccessFile(filename, &file));
+  FileSource source(std::move(file), file_size);
+  Status status = probe(&source, info);
+  if (!status.ok()) {
+    return Status(status.code(), tensorflow::strings::StrCat(
+        filename, ": ", status.error_message()));
+  }
+  return status;
+}
+
+Status ImageProbe::probeBuffer(StringPiece data, ImageInfo *info) {
+  MemorySource source(data);
+  return probe(&source, info);
+}
+
+Status ImageProbe::probe(Source *source, ImageInfo *info) {
+  info->format = IMAGE_FORMAT_UNKNOWN;
+  info->width = 0;
+  info->height = 0;
+  info->frames = 1;
+  info->framesCounted = 1;
+  info->fileSize = source->size();
+
+  const uint8 *magic = NULL;
+  if (!source->bytes(0, 8, &magic).ok()) {
+    return tensorflow::errors::Unimplemented("Too short to be an image");
+  }
+
+  Status status;
+  if (magic[0] == 0xFF && magic[1] == 0xD8) {
+    info->format = IMAGE_FORMAT_JPEG;
+    status = probeJpeg(source, info);
+  } else if (memcmp(magic, "\x89PNG\r\n\x1a\n", 8) == 0) {
+    info->format = IMAGE_FORMAT_PNG;
+    status = probePng(source, info);
+  } else if (memcmp(magic, "GIF87a", 6) == 0 ||
+             memcmp(magic, "GIF89a", 6) == 0) {
+    info->format = IMAGE_FORMAT_GIF;
+    status = probeGif(source, info);
+  } else if (magic[0] == 'B' && magic[1] == 'M') {
+    info->format = IMAGE_FORMAT_BMP;
+    status = probeBmp(source, info);
+  } else {
+    return tensorflow::errors::Unimplemented("Unsupported image format");
+  }
+  TF_RETURN_IF_ERROR(status);
+
+  if (info->width == 0 || info->height == 0) {
+    return tensorflow::errors::DataLoss("Invalid dimensions ", info->width,
+                                        "x", info->height);
+  }
+  return Status::OK();
+}
+
+// Walks the marker segments up to the first start-of-frame, which carries the
+// dimensions. Exif and ICC segments can push it well past the first window.
+Status ImageProbe::probeJpeg(Source *source, ImageInfo *info) {
+  uint64 offset = 2;
+  const uint8 *p = NULL;
+  while (true) {
+    TF_RETURN_IF_ERROR(source->bytes(offset, 2, &p));
+    if (p[0] != 0xFF) {
+      return tensorflow::errors::DataLoss("Bad JPEG marker at ", offset);
+    }
+    uint8 marker = p[1];
+    if (marker == 0xFF) {
+      // Fill byte.
+      offset++;
+      continue;
+    }
+    offset += 2;
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      // Standalone markers carry no length.
+      continue;
+    }
+    if (marker == 0xD9 || marker == 0xDA) {
+      return tensorflow::errors::DataLoss("No JPEG frame header");
+    }
+    TF_RETURN_IF_ERROR(source->bytes(offset, 2, &p));
+    uint32 length = BigEndian16(p);
+    if (length < 2) {
+      return tensorflow::errors::DataLoss("Bad JPEG segment length");
+    }
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+        marker != 0xC8 && marker != 0xCC) {
+      TF_RETURN_IF_ERROR(source->bytes(offset, 8, &p));
+      info->height = BigEndian16(p + 3);
+      info->width = BigEndian16(p + 5);
+      return Status::OK();
+    }
+    offset += length;
+  }
+}
+
+Status ImageProbe::probePng(Source *source, ImageInfo *info) {
+  const uint8 *p = NULL;
+  TF_RETURN_IF_ERROR(source->bytes(8, 16, &p));
+  if (memcmp(p + 4, "IHDR", 4) != 0) {
+    return tensorflow::errors::DataLoss("PNG does not start with IHDR");
+  }
+  info->width = BigEndian32(p + 8);
+  info->height = BigEndian32(p + 12);
+  return Status::OK();
+}
+
+// The logical screen gives the dimensions; the frames are counted by skipping
+// over blocks, since the decoder materializes all of them. Only the first
+// kGifScanBytes are walked; past that the count is extrapolated from the file
+// size, so probing a long animation costs no more than a short one. The
+// extrapolation rounds down, since the decoder may be asked for any frame
+// below the estimate.
+static const uint64 kGifScanBytes = 256 * 1024;
+
+Status ImageProbe::probeGif(Source *source, ImageInfo *info) {
+  const uint8 *p = NULL;
+  TF_RETURN_IF_ERROR(source->bytes(6, 7, &p));
+  info->width = LittleEndian16(p);
+  info->height = LittleEndian16(p + 2);
+  uint64 offset = 13;
+  if (p[4] & 0x80) {
+    offset += 3 * (1 << ((p[4] & 0x07) + 1));
+  }
+  const uint64 frames_start = offset;
+
+  info->frames = 0;
+  while (true) {
+    TF_RETURN_IF_ERROR(source->bytes(offset, 1, &p));
+    if (p[0] == 0x3B) {
+      break;
+    } else if (p[0] == 0x2C) {
+      TF_RETURN_IF_ERROR(source->bytes(offset, 10, &p));
+      offset += 10;
+      if (p[9] & 0x80) {
+        offset += 3 * (1 << ((p[9] & 0x07) + 1));
+      }
+      // LZW minimum code size.
+      offset++;
+      info->frames++;
+    } else if (p[0] == 0x21) {
+      // Introducer and label.
+      offset += 2;
+    } else {
+      return tensorflow::errors::DataLoss("Bad GIF block at ", offset);
+    }
+    // Data sub-blocks, terminated by an empty one.
+    while (true) {
+      TF_RETURN_IF_ERROR(source->bytes(offset, 1, &p));
+      offset += 1 + p[0];
+      if (p[0] == 0) {
+        break;
+      }
+    }
+    if (offset > kGifScanBytes && info->frames > 0) {
+      uint64 scanned = offset - frames_start;
+      uint64 remaining = source->size() > offset ? source->size() - offset : 0;
+      info->framesCounted = info->frames;
+      info->frames += info->frames * remaining / scanned;
+      return Status::OK();
+    }
+  }
+  info->framesCounted = info->frames;
+  if (info->frames == 0) {
+    return tensorflow::errors::DataLoss("GIF has no frames");
+  }
+  return Status::OK();
+}
+
+Status ImageProbe::probeBmp(Source *source, ImageInfo *info) {
+  const uint8 *p = NULL;
+  TF_RETURN_IF_ERROR(source->bytes(14, 12, &p));
+  uint32 header_size = LittleEndian32(p);
+  if (header_size == 12) {
+    info->width = LittleEndian16(p + 4);
+    info->height = LittleEndian16(p + 6);
+  } else {
+    int32_t width = (int32_t) LittleEndian32(p + 4);
+    int32_t height = (int32_t) LittleEndian32(p + 8);
+    // Negative heights are top-down bitmaps.
+    info->width = width < 0 ? 0 : width;
+    info->height = height < 0 ? -height : height;
+  }
+  return Status::OK();
+}
+
+uint64 ImageProbe::decodeBytes(const ImageInfo &info, int ratio) {
+  uint64 width = (info.width + ratio - 1) / ratio;
+  uint64 height = (info.height + ratio - 1) / ratio;
+  uint64 pixels = width * height * info.frames;
+  // uint8 decode output plus its float cast, three channels each.
+  return info.fileSize + pixels * 3 * (sizeof(uint8) + sizeof(float));
+}
+
+const char *ImageProbe::formatName(ImageFormat format) {
+  switch (format) {
+    case IMAGE_FORMAT_JPEG:
+      return "jpeg";
+    case IMAGE_FORMAT_PNG:
+      return "png";
+    case IMAGE_FORMAT_GIF:
+      return "gif";
+    case IMAGE_FORMAT_BMP:
+      return "bmp";
+    default:
+      return "unknown";
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef SRC_IMAGE_PROBE_H_
+#define SRC_IMAGE_PROBE_H_
+
+#include <memory>
+#include <string>
+
+#include "tensorflow/core/lib/core/status.h"
+#include "tensorflow/core/lib/core/stringpiece.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/types.h"
+
+enum ImageFormat {
+  IMAGE_FORMAT_UNKNOWN,
+  IMAGE_FORMAT_JPEG,
+  IMAGE_FORMAT_PNG,
+  IMAGE_FORMAT_GIF,
+  IMAGE_FORMAT_BMP
+};
+
+struct ImageInfo {
+  ImageFormat format;
+  tensorflow::uint32 width;
+  tensorflow::uint32 height;
+  // Frames in the image. Long gifs are only counted part way, the rest is
+  // a lower bound extrapolated from the file size; framesCounted is how many
+  // were actually seen, and is the same as frames for everything else.
+  tensorflow::uint32 frames;
+  tensorflow::uint32 framesCounted;
+  tensorflow::uint64 fileSize;
+};
+
+// Reads just enough of an encoded image to learn its format and dimensions,
+// so admission can be decided before the whole file is read or decoded.
+// Files whose magic isn't recognized come back as Unimplemented, files whose
+// headers don't parse as DataLoss.
+class ImageProbe {
+private:
+  class Source;
+  class FileSource;
+  class MemorySource;
+
+  static tensorflow::Status probe(Source *source, ImageInfo *info);
+  static tensorflow::Status probeJpeg(Source *source, ImageInfo *info);
+  static tensorflow::Status probePng(Source *source, ImageInfo *info);
+  static tensorflow::Status probeGif(Source *source, ImageInfo *info);
+  static tensorflow::Status probeBmp(Source *source, ImageInfo *info);
+public:
+  static tensorflow::Status probeFile(tensorflow::Env *env,
+        const tensorflow::string &filename, ImageInfo *info);
+  static tensorflow::Status probeBuffer(tensorflow::StringPiece data,
+        ImageInfo *info);
+
+  // Bytes needed to decode the image at 1/ratio scale and cast it to float,
+  // including the encoded bytes themselves.
+  static tensorflow::uint64 decodeBytes(const ImageInfo &info, int ratio);
+  static const char *formatName(ImageFormat format);
+};
+
+#endif /* SRC_IMAGE_PROBE_H_ */
@@ -11,13 +11,22 @@ using indexer::IndexEntry;
 using ChCppUtils::ThreadJob;
 using ChCppUtils::FtsOptions;
 
-LabelClient::LabelClient(Config *config) {
+LabelClient::LabelClient(Config *config, StartupReport *startup) {
   this->config = config;
+  this->startup = startup;
   labelImage = NULL;
+  decodeBudget = NULL;
   fts = NULL;
   fsWatch = NULL;
   mImagePool = NULL;
   mNetworkPool = NULL;
+  mClaimPool = NULL;
+  mPublisher = NULL;
+  shardRouter = NULL;
+  archiveSource = new ArchiveSource(config);
+  prefetcher = NULL;
+  autotuner = NULL;
+  imageFilters = {"jpg", "png", "gif"};
   hl_sock_hdl = NULL;
   puc_dns_name_str = (uint8_t *) "127.0.0.1";
   us_host_port_ho = 8888;
@@ -28,6 +37,7 @@ LabelClient::LabelClient(Config *config) {
 }
 
 LabelClient::LabelClient(uint8_t *puc_dns_name_str, uint16_t us_host_port_ho) {
+  this->startup = new StartupReport();
   this->puc_dns_name_str = puc_dns_name_str;
   this->us_host_port_ho = us_host_port_ho; 
 }
@@ -35,26 +45,15 @@ LabelClient::LabelClient(uint8_t *puc_dns_name_str, uint16_t us_host_port_ho) {
 LabelClient::~LabelClient() {
 }
 
-void LabelClient::_onLoad(HttpRequestLoadEvent *event, void *this_) {
-  LabelClient *client = (LabelClient *) this_;
-  return client->onLoad(event);
-}
-
-void LabelClient::onLoad(HttpRequestLoadEvent *event) {
-  HttpResponse *response = event->getResponse();
-  LOG(INFO) << "New Async Request (Complete): " <<
-    response->getResponseCode() << " " << response->getResponseText();
-}
-
 void * LabelClient::_imageRoutine (void *arg, struct event_base *base) {
   LabelClient *client = (LabelClient *) arg;
   return client->imageRoutine();
 }
 
 void * LabelClient::_networkRoutine (void *arg, struct event_base *base) {
-  NetworkMessage *message = (NetworkMessage *) arg;
-  LabelClient *client = (LabelClient *) message->client();
-  return client->networkRoutine(message);
+  NetworkJob *job = (NetworkJob *) arg;
+  LabelClient *client = (LabelClient *) job->message->client();
+  return client->networkRoutine(job);
 }
 
 void *LabelClient::imageRoutine () {
@@ -62,10 +61,10 @@ void *LabelClient::imageRoutine () {
   return NULL;
 }
 
-void *LabelClient::networkRoutine (NetworkMessage *message) {
-  HttpRequest *httpRequest = new HttpRequest();
-  httpRequest->onLoad(LabelClient::_onLoad).bind(this);
-
+void *LabelClient::networkRoutine (NetworkJob *job) {
+  NetworkMessage *message = job->message;
+  Trace::record("network-queue", message->image(), job->queuedUs, Trace::now());
+  TraceSpan span("build-document", message->image());
   json body;
 
   string file = message->image();
@@ -79,20 +78,9 @@ void *LabelClient::networkRoutine (NetworkMessage *message) {
     body[label.label()] = label.score();
   }
 
-  string b = body.dump(); 
-  LOG(INFO) << body.dump(2);
-
-  std::string authorization = "Basic ";
-  std::string user = "elastic:changeme";
-  authorization += base64_encode((unsigned char *) user.data(), user.length());
-
-  LOG(INFO) << "Authorization: " << authorization;
-
+  // Never blocks: the publisher queues, retries and spools on its own.
   string url = esPrefix + "/" + base64;
-  httpRequest->open(EVHTTP_REQ_PUT, url)
-    .setHeader("Authorization", authorization)
-    .setHeader("Content-Type", "application/json; charset=UTF-8")
-    .send((void *) b.data(), b.length());
+  mPublisher->publish(file, url, body.dump());
 
 #if 0
   Packet packet;
@@ -138,10 +126,13 @@ void *LabelClient::networkRoutine (NetworkMessage *message) {
   }
 #endif
 
+  span.end();
+  delete message;
+  delete job;
   return NULL;
 }
 
-void LabelClient::init() {
+void LabelClient::connect() {
     PAL_RET_E e_error = ePAL_RET_FAILURE;
     SOCK_UTIL_HOST_INFO_X x_host_info = {0};
     x_host_info.ui_bitmask |= eSOCK_UTIL_HOST_INFO_DNS_NAME_BM;
@@ -155,18 +146,21 @@ void LabelClient::init() {
     } else {
       LOG(INFO) << "Success connecting to server. " << e_error;
     }
+}
 
-    labelImage = new LabelImage();
-    labelImage->init(LabelClient::_onLabel, this);
-
-    vector<string> filters;
-    filters.emplace_back("jpg");
-    filters.emplace_back("png");
+void LabelClient::initWatch() {
+    watchFilters = imageFilters;
+    if (config->getArchiveEnabled()) {
+      watchFilters.emplace_back("tar");
+      watchFilters.emplace_back("zip");
+    }
     fsWatch = new FsWatch("/tensorflow/tensorflow/examples/ch-tf-label-image-client");
     fsWatch->init();
     fsWatch->OnNewFileCbk(LabelClient::_onNewFile, this);
-    fsWatch->start(filters);
+}
 
+// The whole tree, as walked at startup and again after a shard takeover.
+Fts *LabelClient::newWalk() {
     FtsOptions options;
     memset(&options, 0x00, sizeof(FtsOptions));
     options.bIgnoreRegularFiles = false;
@@ -174,10 +168,95 @@ void LabelClient::init() {
     options.bIgnoreHiddenDirs = true;
     options.bIgnoreRegularDirs = true;
     options.filters.emplace_back<string>("jpg");
-    fts = new Fts ("./tensorflow/examples/ch-tf-label-image-client", &options);
+    options.filters.emplace_back<string>("gif");
+    if (config->getArchiveEnabled()) {
+      options.filters.emplace_back<string>("tar");
+      options.filters.emplace_back<string>("zip");
+    }
+    return new Fts ("./tensorflow/examples/ch-tf-label-image-client", &options);
+}
 
+void LabelClient::initWalk() {
+    fts = newWalk();
+}
+
+int LabelClient::init() {
     mImagePool = new ThreadPool (1, false);
     mNetworkPool = new ThreadPool (1, false);
+    // Takeovers walk the tree again, so they get their own queue rather than
+    // waiting for the first walk to finish.
+    mClaimPool = new ThreadPool (1, false);
+
+    // None of these depend on each other, so they run side by side; the
+    // connect timeout and the graph load used to add up.
+    std::vector<std::future<void>> phases;
+    phases.push_back(std::async(std::launch::async, [this] {
+      startup->time("connect", [this] { connect(); });
+    }));
+    // Shared by the labeler and the prefetcher.
+    decodeBudget = new DecodeBudget(config->getDecodeMemoryBudgetBytes());
+    int model_status = 0;
+    phases.push_back(std::async(std::launch::async, [this, &model_status] {
+      startup->time("load-graph", [this, &model_status] {
+        labelImage = new LabelImage(config, decodeBudget);
+        model_status = labelImage->init(LabelClient::_onLabel, this);
+      });
+    }));
+    phases.push_back(std::async(std::launch::async, [this] {
+      startup->time("fs-watch", [this] { initWatch(); });
+    }));
+    phases.push_back(std::async(std::launch::async, [this] {
+      startup->time("fts", [this] { initWalk(); });
+    }));
+    phases.push_back(std::async(std::launch::async, [this] {
+      startup->time("publisher", [this] {
+        mPublisher = new EsPublisher(config);
+        mPublisher->init();
+      });
+    }));
+    if (config->getPrefetchEnabled()) {
+      phases.push_back(std::async(std::launch::async, [this] {
+        startup->time("prefetch", [this] {
+          prefetcher = new Prefetcher(config, decodeBudget);
+          bool tune = config->getAutotuneEnabled();
+          prefetcher->init(LabelClient::_onAdmit, LabelClient::_onPrefetched,
+                           this, tune ? config->getAutotuneMaxReaders() : 0);
+          if (tune) {
+            autotuner = new Autotuner(config);
+            autotuner->init(prefetcher);
+          }
+        });
+      }));
+    }
+    phases.push_back(std::async(std::launch::async, [this] {
+      startup->time("shard", [this] {
+        shardRouter = new ShardRouter(config);
+        shardRouter->init(LabelClient::_onClaim, this);
+      });
+    }));
+    for (auto &phase : phases) {
+      phase.wait();
+    }
+    // Without a model every image would fail; better not to take any.
+    if (model_status != 0) {
+      LOG(ERROR) << "Failed to initialize the model";
+      return -1;
+    }
+
+    // Pay TensorFlow's lazy initialization before the first real image does.
+    int warm_up_status = 0;
+    startup->time("warm-up", [this, &warm_up_status] {
+      warm_up_status = labelImage->warmUp(config->getWarmUpBatchSizes());
+    });
+    if (warm_up_status != 0) {
+      LOG(ERROR) << "Failed to warm up the model";
+      return -1;
+    }
+
+    // Only now start taking new files.
+    startup->time("ingestion", [this] { fsWatch->start(watchFilters); });
+    startup->log();
+    return 0;
 }
 
 void LabelClient::process() {
@@ -195,6 +274,7 @@ void LabelClient::_onLabel (std::string image, std::vector<std::string> labels,
 }
 
 void LabelClient::onLabel (std::string image, std::vector<std::string> labels, std::vector<float> scores) {
+  startup->firstLabel();
   NetworkMessage *message = new NetworkMessage();
   message->set_client((::google::protobuf::uint64) this);
   message->set_image(image);
@@ -204,7 +284,10 @@ void LabelClient::onLabel (std::string image, std::vector<std::string> labels, s
     label->set_label(labels[pos]);
     label->set_score(scores[pos]);
   }
-  ThreadJob *job = new ThreadJob (LabelClient::_networkRoutine, message);
+  NetworkJob *networkJob = new NetworkJob();
+  networkJob->message = message;
+  networkJob->queuedUs = Trace::now();
+  ThreadJob *job = new ThreadJob (LabelClient::_networkRoutine, networkJob);
   mNetworkPool->addJob(job);
 }
 
@@ -214,8 +297,11 @@ void LabelClient::_onFile (OnFileData &data, void *this_) {
 }
 
 void LabelClient::onFile (OnFileData &data) {
+  if (!shardRouter->claim(data.path)) {
+    return;
+  }
   LOG(INFO) << "File: " << data.path.data();
-  labelImage->process(data.path);
+  label(data.path);
 }
 
 void LabelClient::_onNewFile (OnFileData &data, void *this_) {
@@ -224,8 +310,111 @@ void LabelClient::_onNewFile (OnFileData &data, void *this_) {
 }
 
 void LabelClient::onNewFile (OnFileData &data) {
+  if (!shardRouter->claim(data.path)) {
+    return;
+  }
   LOG(INFO) << "New File: " << data.path.data();
-  labelImage->process(data.path);
+  label(data.path);
+}
+
+// Archives are claimed as a whole and their members labeled straight from
+// the archive, without extracting them. Other files are read ahead of the
+// labeler when prefetching is on.
+void LabelClient::label (const string &path) {
+  if (config->getArchiveEnabled() && ArchiveSource::isArchive(path)) {
+    archiveSource->walk(path, imageFilters, LabelClient::_onMember, this);
+    shardRouter->done(path);
+    return;
+  }
+  if (prefetcher != NULL) {
+    prefetcher->submit(path);
+    return;
+  }
+  labelImage->process(path);
+  shardRouter->done(path);
 }
 
+bool LabelClient::_onAdmit (const std::string &path, uint64_t *reserved, void *this_) {
+  LabelClient *client = (LabelClient *) this_;
+  return client->labelImage->admit(path, reserved) == 0;
+}
+
+void LabelClient::_onPrefetched (const std::vector<PrefetchedFile *> &files, void *this_) {
+  LabelClient *client = (LabelClient *) this_;
+  client->onPrefetched(files);
+}
 
+// Files go through the model as one batch, under the decode reservation the
+// prefetcher holds for them. Those that weren't read ahead are read by the
+// batch itself, which reports any error; rejected ones were already reported.
+void LabelClient::onPrefetched (const std::vector<PrefetchedFile *> &files) {
+  std::vector<BatchImage> images;
+  for (PrefetchedFile *file : files) {
+    if (file->rejected) {
+      continue;
+    }
+    BatchImage image;
+    image.name = file->path;
+    if (file->ok) {
+      image.contents = tensorflow::StringPiece(file->contents);
+    }
+    image.reserved = file->reserved;
+    images.push_back(image);
+  }
+  if (!images.empty()) {
+    labelImage->processBatch(&images);
+  }
+  for (PrefetchedFile *file : files) {
+    shardRouter->done(file->path);
+  }
+  if (autotuner != NULL) {
+    int64_t now = Trace::now();
+    for (PrefetchedFile *file : files) {
+      autotuner->record(now - file->queuedUs);
+    }
+  }
+}
+
+void LabelClient::_onMember (const std::string &key, const char *data, size_t size, void *this_) {
+  LabelClient *client = (LabelClient *) this_;
+  client->onMember(key, data, size);
+}
+
+void LabelClient::onMember (const std::string &key, const char *data, size_t size) {
+  LOG(INFO) << "Member: " << key;
+  labelImage->processBuffer(key, tensorflow::StringPiece(data, size));
+}
+
+void LabelClient::_onClaim (const ShardTakeover &takeover, void *this_) {
+  LabelClient *client = (LabelClient *) this_;
+  client->onClaim(takeover);
+}
+
+// Runs on the shard heartbeat thread, which must keep renewing our lease, so
+// the rescan is queued onto the claim pool.
+void LabelClient::onClaim (const ShardTakeover &takeover) {
+  ShardRescan *rescan = new ShardRescan();
+  rescan->client = this;
+  rescan->takeover = takeover;
+  ThreadJob *job = new ThreadJob (LabelClient::_claimRoutine, rescan);
+  mClaimPool->addJob(job);
+}
+
+void * LabelClient::_claimRoutine (void *arg, struct event_base *base) {
+  ShardRescan *rescan = (ShardRescan *) arg;
+  Fts *walk = rescan->client->newWalk();
+  walk->walk(LabelClient::_onClaimedFile, rescan);
+  delete walk;
+  delete rescan;
+  return NULL;
+}
+
+void LabelClient::_onClaimedFile (OnFileData &data, void *this_) {
+  ShardRescan *rescan = (ShardRescan *) this_;
+  LabelClient *client = rescan->client;
+  if (!client->shardRouter->reclaim(rescan->takeover, data.path)) {
+    return;
+  }
+  LOG(INFO) << "Claimed File: " << data.path;
+  client->label(data.path);
+}
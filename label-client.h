@@ -1,5 +1,6 @@
 
 
+#include <future>
 #include <event2/event.h>
 #include <event2/http.h>
 #include <ch-pal/exp_pal.h>
@@ -17,6 +18,12 @@
 
 #include "config.h"
 #include "label-image.h"
+#include "es-publisher.h"
+#include "startup-report.h"
+#include "shard-router.h"
+#include "archive-source.h"
+#include "prefetcher.h"
+#include "autotuner.h"
 
 
 using label_client_internal::NetworkMessage;
@@ -28,27 +35,51 @@ using ChCppUtils::ThreadPool;
 using ChCppUtils::Fts;
 using ChCppUtils::OnFileData;
 
-using ChCppUtils::Http::Client::HttpRequest;
-using ChCppUtils::Http::Client::HttpResponse;
-using ChCppUtils::Http::Client::HttpRequestLoadEvent;
-
 using json = nlohmann::json;
 
 class LabelClient;
 
+// A label message waiting on the network pool.
+struct NetworkJob {
+    NetworkMessage *message;
+    int64_t queuedUs;
+};
+
+// A walk for the unfinished paths of lost shard peers, on the claim pool.
+struct ShardRescan {
+    LabelClient *client;
+    ShardTakeover takeover;
+};
+
 class LabelClient {
 private:
     LabelImage *labelImage;
+    DecodeBudget *decodeBudget;
     Fts *fts;
     FsWatch *fsWatch;
+    vector<string> imageFilters;
+    vector<string> watchFilters;
     PAL_SOCK_HDL hl_sock_hdl;
     uint8_t *puc_dns_name_str;
     uint16_t us_host_port_ho;
     ThreadPool *mImagePool;
     ThreadPool *mNetworkPool;
+    ThreadPool *mClaimPool;
+    EsPublisher *mPublisher;
+    ShardRouter *shardRouter;
+    ArchiveSource *archiveSource;
+    Prefetcher *prefetcher;
+    Autotuner *autotuner;
     Config *config;
+    StartupReport *startup;
     string esPrefix;
 
+    void connect();
+    void initWatch();
+    void initWalk();
+    Fts *newWalk();
+    void label(const string &path);
+
     static void _onFile (OnFileData &data, void *this_);
     void onFile (OnFileData &data);
 
@@ -59,17 +90,27 @@ private:
     static void *_networkRoutine (void *arg, struct event_base *base);
 
     void *imageRoutine ();
-    void *networkRoutine (NetworkMessage *message);
-
-    static void _onLoad(HttpRequestLoadEvent *event, void *this_);
-    void onLoad(HttpRequestLoadEvent *event);
+    void *networkRoutine (NetworkJob *job);
 
     static void _onNewFile (OnFileData &data, void *this_);
     void onNewFile (OnFileData &data);
+
+    static void _onMember (const std::string &key, const char *data, size_t size, void *this_);
+    void onMember (const std::string &key, const char *data, size_t size);
+
+    static bool _onAdmit (const std::string &path, uint64_t *reserved, void *this_);
+    static void _onPrefetched (const std::vector<PrefetchedFile *> &files, void *this_);
+    void onPrefetched (const std::vector<PrefetchedFile *> &files);
+
+    static void _onClaim (const ShardTakeover &takeover, void *this_);
+    void onClaim (const ShardTakeover &takeover);
+
+    static void *_claimRoutine (void *arg, struct event_base *base);
+    static void _onClaimedFile (OnFileData &data, void *this_);
 public:
-    LabelClient(Config *config);
+    LabelClient(Config *config, StartupReport *startup);
     LabelClient(uint8_t *puc_dns_name_str, uint16_t us_host_port_ho);
     ~LabelClient();
-    void init();
+    int init();
     void process();
 };
@@ -0,0 +1,184 @@
+#include <string>
+#include <vector>
+
+#include "tensorflow/core/lib/core/status_test_util.h"
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "label-image.h"
+
+class LabelImageTest : public ::testing::Test {
+ protected:
+  static std::vector<float> CropBoxes(LabelImage *labelImage, int width,
+                                      int height) {
+    ImageInfo info = {IMAGE_FORMAT_JPEG, (tensorflow::uint32) width,
+                      (tensorflow::uint32) height, 1, 1, 0};
+    return labelImage->CropBoxes(info);
+  }
+
+  static bool SelfTest(LabelImage *labelImage) {
+    return labelImage->self_test;
+  }
+
+  static std::vector<tensorflow::int32> SampleFrames(LabelImage *labelImage,
+                                                     int frames) {
+    return labelImage->SampleFrames(frames);
+  }
+
+  // Runs a gif through the preprocessing graph alone, at 8x8, as if the probe
+  // had counted the given number of frames.
+  static tensorflow::Status DecodeGif(LabelImage *labelImage,
+                                      const std::string &gif, int frames,
+                                      std::vector<tensorflow::Tensor> *out) {
+    TF_RETURN_IF_ERROR(labelImage->BuildPreprocessGraph(8, 8, 0, 255,
+        &labelImage->preprocessSession));
+    ImageInfo info;
+    TF_RETURN_IF_ERROR(ImageProbe::probeBuffer(gif, &info));
+    info.frames = frames;
+    tensorflow::StringPiece contents(gif);
+    return labelImage->ReadTensorFromImageFile("animated.gif", &contents, info,
+                                               1, out);
+  }
+};
+
+namespace {
+
+Config *AdmissionConfig() {
+  return LoadTestConfig("label-image-admission", {
+    {"decode", {
+      {"memory-budget-mb", 1},
+      {"reduce-above-mb", 1},
+      {"max-megapixels", 400}
+    }}
+  });
+}
+
+// Images that can't be decoded are turned away from the header alone, before
+// any of the decode budget is reserved or the model is needed.
+TEST_F(LabelImageTest, RejectsBeforeReserving) {
+  Config *config = AdmissionConfig();
+  DecodeBudget budget(config->getDecodeMemoryBudgetBytes());
+  LabelImage labelImage(config, &budget);
+
+  // Over the megapixel limit.
+  std::string huge = TestGif(30000, 30000, 1);
+  EXPECT_EQ(-1, labelImage.processBuffer("huge.gif", huge));
+  // Within it, but 15 MB to decode against a 1 MB budget.
+  std::string large = TestGif(1000, 1000, 1);
+  EXPECT_EQ(-1, labelImage.processBuffer("large.gif", large));
+  // Not an image.
+  EXPECT_EQ(-1, labelImage.processBuffer("notes.txt", "not an image at all"));
+
+  std::vector<BatchImage> batch(2);
+  batch[0].name = "huge.gif";
+  batch[0].contents = huge;
+  batch[1].name = "large.gif";
+  batch[1].contents = large;
+  EXPECT_EQ(0, labelImage.processBatch(&batch));
+  EXPECT_TRUE(tensorflow::errors::IsResourceExhausted(batch[0].status));
+  EXPECT_TRUE(tensorflow::errors::IsResourceExhausted(batch[1].status));
+
+  EXPECT_EQ(0u, budget.peak());
+  EXPECT_EQ(0u, budget.waits());
+}
+
+// The test has no model data, so init fails; warm-up must say so rather than
+// run the missing sessions.
+TEST_F(LabelImageTest, WarmUpFailsWithoutModel) {
+  Config *config = AdmissionConfig();
+  DecodeBudget budget(config->getDecodeMemoryBudgetBytes());
+  LabelImage labelImage(config, &budget);
+  EXPECT_NE(0, labelImage.init(NULL, NULL));
+  EXPECT_EQ(-1, labelImage.warmUp({1}));
+}
+
+TEST_F(LabelImageTest, SelfTestComesFromConfig) {
+  LabelImage off(AdmissionConfig(), NULL);
+  EXPECT_FALSE(SelfTest(&off));
+  LabelImage on(LoadTestConfig("label-image-self-test", {{"self-test", true}}),
+                NULL);
+  EXPECT_TRUE(SelfTest(&on));
+}
+
+// Built from a model path alone, with no config, budget or callback.
+TEST_F(LabelImageTest, RunsWithoutConfig) {
+  LabelImage labelImage("", "missing.pb");
+  EXPECT_FALSE(SelfTest(&labelImage));
+  EXPECT_NE(0, labelImage.init(NULL, NULL));
+
+  std::vector<BatchImage> batch(1);
+  batch[0].name = "notes.txt";
+  batch[0].contents = "not an image at all";
+  EXPECT_EQ(0, labelImage.processBatch(&batch));
+  EXPECT_TRUE(tensorflow::errors::IsUnimplemented(batch[0].status));
+}
+
+Config *CropConfig(const std::string &name, int grid) {
+  return LoadTestConfig(name, {
+    {"multi-crop", {{"enabled", true}, {"grid", grid}, {"full", true}}}
+  });
+}
+
+// Full box, center square and four tiles.
+TEST_F(LabelImageTest, CropBoxesCoverTheGrid) {
+  LabelImage labelImage(CropConfig("label-image-crop-2", 2), NULL);
+  EXPECT_EQ(6u * 4, CropBoxes(&labelImage, 400, 300).size());
+}
+
+// A 1x1 grid is the full box again, and so is the center of a square image.
+TEST_F(LabelImageTest, CropBoxesSkipDuplicates) {
+  LabelImage labelImage(CropConfig("label-image-crop-1", 1), NULL);
+  std::vector<float> wide = CropBoxes(&labelImage, 400, 300);
+  EXPECT_EQ(2u * 4, wide.size());
+  std::vector<float> square = CropBoxes(&labelImage, 300, 300);
+  EXPECT_EQ(std::vector<float>({0.0f, 0.0f, 1.0f, 1.0f}), square);
+}
+
+Config *GifConfig(const std::string &name, int stride, int maxFrames) {
+  return LoadTestConfig(name, {
+    {"gif", {{"frame-stride", stride}, {"max-frames", maxFrames}}}
+  });
+}
+
+TEST_F(LabelImageTest, SampleFramesTakesEveryStrideth) {
+  LabelImage labelImage(GifConfig("label-image-stride", 3, 100), NULL);
+  EXPECT_EQ(std::vector<tensorflow::int32>({0, 3, 6, 9}),
+            SampleFrames(&labelImage, 10));
+  EXPECT_EQ(std::vector<tensorflow::int32>({0, 3, 6, 9}),
+            SampleFrames(&labelImage, 12));
+}
+
+TEST_F(LabelImageTest, SampleFramesThinsToMaxFrames) {
+  LabelImage labelImage(GifConfig("label-image-thin", 2, 4), NULL);
+  // Fifty strided frames, spread evenly over four.
+  EXPECT_EQ(std::vector<tensorflow::int32>({0, 24, 50, 74}),
+            SampleFrames(&labelImage, 100));
+}
+
+TEST_F(LabelImageTest, SampleFramesOfASingleFrame) {
+  LabelImage labelImage(GifConfig("label-image-single", 5, 4), NULL);
+  EXPECT_EQ(std::vector<tensorflow::int32>({0}), SampleFrames(&labelImage, 1));
+}
+
+// Frames of a real animation come out as one batch row each, in order. A
+// frame count over the real one, as a long gif's estimate can be, is clamped
+// to the last frame rather than failing the image.
+TEST_F(LabelImageTest, DecodesSampledGifFrames) {
+  LabelImage labelImage(GifConfig("label-image-decode", 1, 8), NULL);
+  std::string gif = SolidGif(16, 12, 3);
+  for (int frames : {3, 4}) {
+    std::vector<tensorflow::Tensor> out;
+    TF_ASSERT_OK(DecodeGif(&labelImage, gif, frames, &out));
+    ASSERT_EQ(1u, out.size());
+    EXPECT_EQ(tensorflow::TensorShape({frames, 8, 8, 3}), out[0].shape());
+    auto pixels = out[0].tensor<float, 4>();
+    // Black, red, green, then the green last frame again.
+    EXPECT_FLOAT_EQ(0.0f, pixels(0, 4, 4, 0));
+    EXPECT_FLOAT_EQ(1.0f, pixels(1, 4, 4, 0));
+    EXPECT_FLOAT_EQ(0.0f, pixels(1, 4, 4, 1));
+    EXPECT_FLOAT_EQ(1.0f, pixels(2, 4, 4, 1));
+    EXPECT_FLOAT_EQ(1.0f, pixels(frames - 1, 4, 4, 1));
+  }
+}
+
+}  // namespace
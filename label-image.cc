@@ -1,7 +1,28 @@
 
+#include <unistd.h>
+
+#include "tensorflow/core/framework/allocator.h"
+
 #include "label-image.h"
 
-LabelImage::LabelImage() {
+// Resident set size of the process, from /proc/self/statm.
+static long ResidentSetBytes() {
+  long pages = 0;
+  std::ifstream statm("/proc/self/statm");
+  statm >> pages >> pages;
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Side of the synthetic image encoded for warm-up.
+static const int kWarmUpImageSize = 8;
+
+// Contents buffers bigger than this are given back after each image instead of
+// being kept around for the next one.
+static const size_t kMaxRetainedContents = 32 * 1024 * 1024;
+
+LabelImage::LabelImage(Config *config, DecodeBudget *budget) {
+  this->config = config;
+  this->budget = budget;
   root = "";
   graph =
       "tensorflow/examples/ch-tf-label-image-client/data/inception_v3_2016_08_28_frozen.pb";
@@ -14,10 +35,26 @@ LabelImage::LabelImage() {
   input_std = 255;
   input_layer = "input";
   output_layer = "InceptionV3/Predictions/Reshape_1";
-  self_test = false;
+  self_test = config != NULL && config->getSelfTest();
+  multiCrop = config != NULL && config->getMultiCropEnabled();
+  onLabel = NULL;
+  onLabelThis = NULL;
+  labelCount = 0;
+  processed = 0;
+  statsAllocations = 0;
+  statsArenaAllocations = 0;
+  inferenceUs = 0;
+  statsInferenceUs = 0;
+  statsReportUs = Trace::now();
+  admitted = 0;
+  reduced = 0;
+  rejectedUnsupported = 0;
+  rejectedCorrupt = 0;
+  rejectedTooLarge = 0;
 }
 
-LabelImage::LabelImage(string root, string graph) {
+LabelImage::LabelImage(string root, string graph)
+    : LabelImage(NULL, NULL) {
   this->root = root;
   this->graph = graph;
 }
@@ -56,6 +93,29 @@ int LabelImage::init(OnLabel onLabel, void *this_) {
     return -1;
   }
   LOG(INFO) << "LoadGraph success";
+
+  // The preprocessing and top-k graphs and the labels never change, so they
+  // are set up once here instead of for every image.
+  Status preprocess_status = BuildPreprocessGraph(input_height, input_width,
+      input_mean, input_std, &preprocessSession);
+  if (!preprocess_status.ok()) {
+    LOG(ERROR) << preprocess_status;
+    return -1;
+  }
+  Status top_k_status = BuildTopKGraph(&topKSession);
+  if (!top_k_status.ok()) {
+    LOG(ERROR) << top_k_status;
+    return -1;
+  }
+  Status read_labels_status = ReadLabelsFile(labels, &labelNames, &labelCount);
+  if (!read_labels_status.ok()) {
+    LOG(ERROR) << read_labels_status;
+    return -1;
+  }
+
+  if (config != NULL && config->getStatsReportEvery() > 0) {
+    tensorflow::EnableCPUAllocatorStats(true);
+  }
   return 0;
 }
 
@@ -64,7 +124,9 @@ Status LabelImage::ReadEntireFile(tensorflow::Env* env, const string& filename,
   tensorflow::uint64 file_size = 0;
   TF_RETURN_IF_ERROR(env->GetFileSize(filename, &file_size));
 
-  string contents;
+  // Read straight into the tensor's string so its capacity carries over from
+  // one image to the next.
+  string &contents = output->scalar<string>()();
   contents.resize(file_size);
 
   std::unique_ptr<tensorflow::RandomAccessFile> file;
@@ -77,81 +139,318 @@ Status LabelImage::ReadEntireFile(tensorflow::Env* env, const string& filename,
                                         "' expected ", file_size, " got ",
                                         data.size());
   }
-  output->scalar<string>()() = data.ToString();
+  if (data.data() != contents.data()) {
+    contents.assign(data.data(), data.size());
+  }
   return Status::OK();
 }
 
-// Given an image file name, read in the data, try to decode it as an image,
-// resize it to the requested size, and then scale the values as desired.
-Status LabelImage::ReadTensorFromImageFile(const string& file_name, const int input_height,
+// Builds the graph that takes the encoded image fed into "input", decodes it,
+// resizes it to the requested size, and then scales the values as desired.
+// There is one branch per format, all reading the same placeholder; only the
+// branch whose output gets fetched is run.
+Status LabelImage::BuildPreprocessGraph(const int input_height,
                                const int input_width, const float input_mean,
                                const float input_std,
-                               std::vector<Tensor>* out_tensors) {
+                               std::unique_ptr<tensorflow::Session>* session) {
   auto root = tensorflow::Scope::NewRootScope();
   using namespace ::tensorflow::ops;  // NOLINT(build/namespaces)
 
-  string input_name = "file_reader";
-  string output_name = "normalized";
-
-  // read file_name into a tensor named input
-  Tensor input(tensorflow::DT_STRING, tensorflow::TensorShape());
-  TF_RETURN_IF_ERROR(
-      ReadEntireFile(tensorflow::Env::Default(), file_name, &input));
-
   // use a placeholder to read input data
   auto file_reader =
       Placeholder(root.WithOpName("input"), tensorflow::DataType::DT_STRING);
+  auto size = Const(root.WithOpName("size"), {input_height, input_width});
+  // Normalized [y1, x1, y2, x2] crops, all taken from the one decoded image.
+  auto crop_boxes =
+      Placeholder(root.WithOpName("crop_boxes"), tensorflow::DT_FLOAT);
+  auto crop_box_indices =
+      Placeholder(root.WithOpName("crop_box_indices"), tensorflow::DT_INT32);
 
-  std::vector<std::pair<string, tensorflow::Tensor>> inputs = {
-      {"input", input},
+  const int wanted_channels = 3;
+  std::vector<std::pair<string, tensorflow::Output>> readers = {
+      {"png", DecodePng(root.WithOpName("png_reader"), file_reader,
+                        DecodePng::Channels(wanted_channels))},
+      {"bmp", DecodeBmp(root.WithOpName("bmp_reader"), file_reader)},
+      {"jpeg", DecodeJpeg(root.WithOpName("jpeg_reader"), file_reader,
+                          DecodeJpeg::Channels(wanted_channels))},
+      // Reduced resolution decodes for jpegs too big to decode in full.
+      {"jpeg_2", DecodeJpeg(root.WithOpName("jpeg_reader_2"), file_reader,
+                            DecodeJpeg::Channels(wanted_channels).Ratio(2))},
+      {"jpeg_4", DecodeJpeg(root.WithOpName("jpeg_reader_4"), file_reader,
+                            DecodeJpeg::Channels(wanted_channels).Ratio(4))},
+      {"jpeg_8", DecodeJpeg(root.WithOpName("jpeg_reader_8"), file_reader,
+                            DecodeJpeg::Channels(wanted_channels).Ratio(8))},
   };
+  for (auto& reader : readers) {
+    // Now cast the image data to float so we can do normal math on it.
+    auto float_caster = Cast(root.WithOpName("float_caster_" + reader.first),
+                             reader.second, tensorflow::DT_FLOAT);
+    // The convention for image ops in TensorFlow is that all images are
+    // expected to be in batches, so that they're four-dimensional arrays with
+    // indices of [batch, height, width, channel]. Because we only have a
+    // single image, we have to add a batch dimension of 1 to the start with
+    // ExpandDims().
+    auto dims_expander = ExpandDims(root, float_caster, 0);
+    // Bilinearly resize the image to fit the required dimensions.
+    auto resized = ResizeBilinear(root, dims_expander, size);
+    // Subtract the mean and divide by the scale.
+    Div(root.WithOpName("normalized_" + reader.first),
+        Sub(root, resized, {input_mean}), {input_std});
+    // Multi-crop mode cuts every box out of the same decode instead, each
+    // resized to the model input, giving one batch row per crop.
+    auto crops = CropAndResize(root, dims_expander, crop_boxes,
+                               crop_box_indices, size);
+    Div(root.WithOpName("cropped_" + reader.first),
+        Sub(root, crops, {input_mean}), {input_std});
+  }
+
+  // The gif decoder returns every frame as a 4-D tensor already. The sampled
+  // frames fed into "frame_indices" are picked out and resized together, so
+  // the model sees them as one batch. The indices come from the probe's frame
+  // count, which for long gifs is an estimate, so they are clamped to the
+  // last frame actually decoded.
+  auto frame_indices =
+      Placeholder(root.WithOpName("frame_indices"), tensorflow::DT_INT32);
+  auto gif_reader = DecodeGif(root.WithOpName("gif_reader"), file_reader);
+  auto last_frame = Sub(root, Slice(root, Shape(root, gif_reader), {0}, {1}),
+                        {1});
+  auto frames = Gather(root.WithOpName("gif_frames"), gif_reader,
+                       Minimum(root, frame_indices, last_frame));
+  auto frames_caster = Cast(root.WithOpName("float_caster_gif"), frames,
+                            tensorflow::DT_FLOAT);
+  auto frames_resized = ResizeBilinear(root, frames_caster, size);
+  Div(root.WithOpName("normalized_gif"),
+      Sub(root, frames_resized, {input_mean}), {input_std});
 
-  // Now try to figure out what kind of file it is and decode it.
-  const int wanted_channels = 3;
-  tensorflow::Output image_reader;
-  if (tensorflow::StringPiece(file_name).ends_with(".png")) {
-    image_reader = DecodePng(root.WithOpName("png_reader"), file_reader,
-                             DecodePng::Channels(wanted_channels));
-  } else if (tensorflow::StringPiece(file_name).ends_with(".gif")) {
-    // gif decoder returns 4-D tensor, remove the first dim
-    image_reader =
-        Squeeze(root.WithOpName("squeeze_first_dim"),
-                DecodeGif(root.WithOpName("gif_reader"), file_reader));
-  } else if (tensorflow::StringPiece(file_name).ends_with(".bmp")) {
-    image_reader = DecodeBmp(root.WithOpName("bmp_reader"), file_reader);
-  } else {
-    // Assume if it's neither a PNG nor a GIF then it must be a JPEG.
-    image_reader = DecodeJpeg(root.WithOpName("jpeg_reader"), file_reader,
-                              DecodeJpeg::Channels(wanted_channels));
-  }
-  // Now cast the image data to float so we can do normal math on it.
-  auto float_caster =
-      Cast(root.WithOpName("float_caster"), image_reader, tensorflow::DT_FLOAT);
-  // The convention for image ops in TensorFlow is that all images are expected
-  // to be in batches, so that they're four-dimensional arrays with indices of
-  // [batch, height, width, channel]. Because we only have a single image, we
-  // have to add a batch dimension of 1 to the start with ExpandDims().
-  auto dims_expander = ExpandDims(root, float_caster, 0);
-  // Bilinearly resize the image to fit the required dimensions.
-  auto resized = ResizeBilinear(
-      root, dims_expander,
-      Const(root.WithOpName("size"), {input_height, input_width}));
-  // Subtract the mean and divide by the scale.
-  Div(root.WithOpName(output_name), Sub(root, resized, {input_mean}),
-      {input_std});
-
-  // This runs the GraphDef network definition that we've just constructed, and
-  // returns the results in the output tensor.
   tensorflow::GraphDef graph;
   TF_RETURN_IF_ERROR(root.ToGraphDef(&graph));
 
-  std::unique_ptr<tensorflow::Session> session(
-      tensorflow::NewSession(tensorflow::SessionOptions()));
-  TF_RETURN_IF_ERROR(session->Create(graph));
-  TF_RETURN_IF_ERROR(session->Run({inputs}, {output_name}, {}, out_tensors));
+  session->reset(tensorflow::NewSession(tensorflow::SessionOptions()));
+  TF_RETURN_IF_ERROR((*session)->Create(graph));
+  return Status::OK();
+}
+
+// Probes the image header and decides whether it may be decoded, and at what
+// jpeg scale ratio. On success the decode memory to reserve is returned in
+// reserved; corrupt, unsupported and oversized images are rejected before
+// any of their data is read. Images already in memory are probed in place.
+Status LabelImage::Admit(const string& file_name,
+                         const tensorflow::StringPiece* contents,
+                         ImageInfo* info, int* ratio,
+                         tensorflow::uint64* reserved) {
+  Status probe_status = contents != NULL ?
+      ImageProbe::probeBuffer(*contents, info) :
+      ImageProbe::probeFile(tensorflow::Env::Default(), file_name, info);
+  if (!probe_status.ok()) {
+    if (tensorflow::errors::IsUnimplemented(probe_status)) {
+      rejectedUnsupported++;
+    } else {
+      rejectedCorrupt++;
+    }
+    return probe_status;
+  }
+
+  *ratio = 1;
+  *reserved = ImageProbe::decodeBytes(*info, 1);
+  if (config == NULL || budget == NULL) {
+    return Status::OK();
+  }
+
+  tensorflow::uint64 pixels = (tensorflow::uint64) info->width * info->height;
+  if (pixels > config->getDecodeMaxMegapixels() * 1000000ULL) {
+    rejectedTooLarge++;
+    return tensorflow::errors::ResourceExhausted(file_name, " is ",
+        info->width, "x", info->height, ", over the megapixel limit");
+  }
+  if (info->format == IMAGE_FORMAT_JPEG) {
+    while (*reserved > config->getDecodeReduceAboveBytes() && *ratio < 8) {
+      *ratio *= 2;
+      *reserved = ImageProbe::decodeBytes(*info, *ratio);
+    }
+  }
+  if (*reserved > budget->budget()) {
+    rejectedTooLarge++;
+    return tensorflow::errors::ResourceExhausted(file_name, " needs ",
+        *reserved, " bytes to decode, over the decode memory budget");
+  }
+  return Status::OK();
+}
+
+// Admissions are counted when the image goes on to be decoded, so one that
+// was admitted ahead of time by admit() isn't counted twice.
+void LabelImage::CountAdmitted(int ratio) {
+  if (ratio > 1) {
+    reduced++;
+  }
+  admitted++;
+}
+
+int LabelImage::admit(string image, tensorflow::uint64* reserved) {
+  ImageInfo info;
+  int ratio = 1;
+  string image_path = tensorflow::io::JoinPath(root, image);
+  TraceSpan probe_span("probe", image_path);
+  Status admit_status = Admit(image_path, NULL, &info, &ratio, reserved);
+  if (!admit_status.ok()) {
+    LOG(ERROR) << "Rejected: " << admit_status;
+    return -1;
+  }
+  return 0;
+}
+
+// Picks which frames of an animated image get labeled: every
+// "gif.frame-stride"th frame, thinned out evenly to at most "gif.max-frames".
+std::vector<int32> LabelImage::SampleFrames(int frames) {
+  int stride = 1;
+  int max_frames = 1;
+  if (config != NULL) {
+    stride = std::max(1, config->getGifFrameStride());
+    max_frames = std::max(1, config->getGifMaxFrames());
+  }
+  std::vector<int32> strided;
+  for (int frame = 0; frame < frames; frame += stride) {
+    strided.push_back(frame);
+  }
+  if ((int) strided.size() <= max_frames) {
+    return strided;
+  }
+  std::vector<int32> sampled;
+  for (int pos = 0; pos < max_frames; ++pos) {
+    sampled.push_back(strided[(size_t) pos * strided.size() / max_frames]);
+  }
+  return sampled;
+}
+
+// Boxes for multi-crop mode: optionally the whole image, a center square on
+// the shorter side, and a "multi-crop.grid" x "multi-crop.grid" set of tiles.
+// A box that repeats an earlier one, such as the center of a square image or
+// a 1x1 grid, is left out rather than run through the model twice.
+std::vector<float> LabelImage::CropBoxes(const ImageInfo& info) {
+  std::vector<float> boxes;
+  auto add = [&boxes](float top, float left, float bottom, float right) {
+    for (size_t pos = 0; pos < boxes.size(); pos += 4) {
+      if (boxes[pos] == top && boxes[pos + 1] == left &&
+          boxes[pos + 2] == bottom && boxes[pos + 3] == right) {
+        return;
+      }
+    }
+    boxes.insert(boxes.end(), {top, left, bottom, right});
+  };
+  if (config->getMultiCropFull()) {
+    add(0.0f, 0.0f, 1.0f, 1.0f);
+  }
+  float side = std::min(info.width, info.height);
+  float height = side / info.height;
+  float width = side / info.width;
+  float top = (1.0f - height) / 2;
+  float left = (1.0f - width) / 2;
+  add(top, left, top + height, left + width);
+
+  const int grid = std::max(1, config->getMultiCropGrid());
+  for (int row = 0; row < grid; ++row) {
+    for (int column = 0; column < grid; ++column) {
+      add((float) row / grid, (float) column / grid,
+          (float) (row + 1) / grid, (float) (column + 1) / grid);
+    }
+  }
+  return boxes;
+}
+
+// Whether the rows of an image's batch are averaged rather than maxed, per
+// "gif.aggregate" or "multi-crop.aggregate". Without a config it is their
+// defaults.
+bool LabelImage::MeanAggregate(ImageFormat format) {
+  if (config == NULL) {
+    return format != IMAGE_FORMAT_GIF;
+  }
+  const string& aggregate = format == IMAGE_FORMAT_GIF ?
+      config->getGifAggregate() : config->getMultiCropAggregate();
+  return aggregate == "mean";
+}
+
+// Folds the per-row scores of a batch (gif frames or crops) into a single row,
+// taking either the maximum or the mean of each class over the rows.
+Status LabelImage::AggregateBatch(const Tensor& batch_scores, bool mean,
+                                  Tensor* scores) {
+  const tensorflow::int64 rows = batch_scores.dim_size(0);
+  const tensorflow::int64 classes = batch_scores.dim_size(1);
+
+  *scores = Tensor(&arena, tensorflow::DT_FLOAT,
+                   tensorflow::TensorShape({1, classes}));
+  // Slices of a shared batch output need not be aligned.
+  auto in = batch_scores.unaligned_flat<float>();
+  auto out = scores->matrix<float>();
+  for (tensorflow::int64 c = 0; c < classes; ++c) {
+    float value = in(c);
+    for (tensorflow::int64 r = 1; r < rows; ++r) {
+      float row = in(r * classes + c);
+      value = mean ? value + row : std::max(value, row);
+    }
+    out(0, c) = mean ? value / rows : value;
+  }
   return Status::OK();
 }
 
+// Given an image file name, read in the data and run it through the
+// preprocessing branch for its probed format. When contents are given they
+// are used instead of reading the file.
+Status LabelImage::ReadTensorFromImageFile(const string& file_name,
+                               const tensorflow::StringPiece* contents,
+                               const ImageInfo& info, const int ratio,
+                               std::vector<Tensor>* out_tensors) {
+  // read file_name into the reused contents tensor
+  Tensor& input = arena.contents();
+  TraceSpan read_span("read", file_name);
+  if (contents != NULL) {
+    input.scalar<string>()().assign(contents->data(), contents->size());
+  } else {
+    TF_RETURN_IF_ERROR(
+        ReadEntireFile(tensorflow::Env::Default(), file_name, &input));
+  }
+  read_span.end();
+
+  std::vector<std::pair<string, tensorflow::Tensor>> inputs = {
+      {"input", input},
+  };
+  if (info.format == IMAGE_FORMAT_GIF) {
+    std::vector<int32> frames = SampleFrames(info.frames);
+    Tensor frame_indices(&arena, tensorflow::DT_INT32,
+                         tensorflow::TensorShape({(int64_t) frames.size()}));
+    std::copy(frames.begin(), frames.end(),
+              frame_indices.flat<int32>().data());
+    inputs.emplace_back("frame_indices", frame_indices);
+  }
+  const bool crop = multiCrop && info.format != IMAGE_FORMAT_GIF;
+  if (crop) {
+    std::vector<float> boxes = CropBoxes(info);
+    const tensorflow::int64 count = boxes.size() / 4;
+    Tensor crop_boxes(&arena, tensorflow::DT_FLOAT,
+                      tensorflow::TensorShape({count, 4}));
+    std::copy(boxes.begin(), boxes.end(), crop_boxes.flat<float>().data());
+    Tensor crop_box_indices(&arena, tensorflow::DT_INT32,
+                            tensorflow::TensorShape({count}));
+    crop_box_indices.flat<int32>().setZero();
+    inputs.emplace_back("crop_boxes", crop_boxes);
+    inputs.emplace_back("crop_box_indices", crop_box_indices);
+  }
+
+  // The probe already told us what kind of file it is, whatever its name.
+  string output_name = tensorflow::strings::StrCat(
+      crop ? "cropped_" : "normalized_", ImageProbe::formatName(info.format));
+  if (ratio > 1) {
+    tensorflow::strings::StrAppend(&output_name, "_", ratio);
+  }
+
+  TraceSpan decode_span("decode", file_name);
+  Status run_status =
+      preprocessSession->Run({inputs}, {output_name}, {}, out_tensors);
+  decode_span.end();
+  if (input.scalar<string>()().capacity() > kMaxRetainedContents) {
+    input.scalar<string>()() = string();
+  }
+  return run_status;
+}
+
 // Takes a file name, and loads a list of labels from it, one per line, and
 // returns a vector of the strings. It pads with empty strings so the length
 // of the result is a multiple of 16, because our model expects that.
@@ -175,50 +474,65 @@ Status LabelImage::ReadLabelsFile(const string& file_name, std::vector<string>*
   return Status::OK();
 }
 
-// Analyzes the output of the Inception graph to retrieve the highest scores and
-// their positions in the tensor, which correspond to categories.
-Status LabelImage::GetTopLabels(const std::vector<Tensor>& outputs, int how_many_labels,
-                    Tensor* indices, Tensor* scores) {
+// Builds the graph that picks the highest scores out of the model output fed
+// into "scores". How many to pick is fed into "k".
+Status LabelImage::BuildTopKGraph(std::unique_ptr<tensorflow::Session>* session) {
   auto root = tensorflow::Scope::NewRootScope();
   using namespace ::tensorflow::ops;  // NOLINT(build/namespaces)
 
-  string output_name = "top_k";
-  TopK(root.WithOpName(output_name), outputs[0], how_many_labels);
-  // This runs the GraphDef network definition that we've just constructed, and
-  // returns the results in the output tensors.
+  auto scores = Placeholder(root.WithOpName("scores"), tensorflow::DT_FLOAT);
+  auto k = Placeholder(root.WithOpName("k"), tensorflow::DT_INT32);
+  TopK(root.WithOpName("top_k"), scores, k);
+
   tensorflow::GraphDef graph;
   TF_RETURN_IF_ERROR(root.ToGraphDef(&graph));
 
-  std::unique_ptr<tensorflow::Session> session(
-      tensorflow::NewSession(tensorflow::SessionOptions()));
-  TF_RETURN_IF_ERROR(session->Create(graph));
+  session->reset(tensorflow::NewSession(tensorflow::SessionOptions()));
+  TF_RETURN_IF_ERROR((*session)->Create(graph));
+  return Status::OK();
+}
+
+// Analyzes the output of the Inception graph to retrieve the highest scores and
+// their positions in the tensor, which correspond to categories.
+Status LabelImage::GetTopLabels(const std::vector<Tensor>& outputs, int how_many_labels,
+                    Tensor* indices, Tensor* scores) {
+  auto count = topKCounts.find(how_many_labels);
+  if (count == topKCounts.end()) {
+    Tensor k(&arena, tensorflow::DT_INT32, tensorflow::TensorShape());
+    k.scalar<int32>()() = how_many_labels;
+    count = topKCounts.emplace(how_many_labels, k).first;
+  }
+
   // The TopK node returns two outputs, the scores and their original indices,
   // so we have to append :0 and :1 to specify them both.
-  std::vector<Tensor> out_tensors;
-  TF_RETURN_IF_ERROR(session->Run({}, {output_name + ":0", output_name + ":1"},
-                                  {}, &out_tensors));
-  *scores = out_tensors[0];
-  *indices = out_tensors[1];
+  topKTensors.clear();
+  TF_RETURN_IF_ERROR(topKSession->Run(
+      {{"scores", outputs[0]}, {"k", count->second}},
+      {"top_k:0", "top_k:1"}, {}, &topKTensors));
+  *scores = topKTensors[0];
+  *indices = topKTensors[1];
   return Status::OK();
 }
 
-// Given the output of a model run, and the name of a file containing the labels
-// this prints out the top five highest-scoring values.
+// Given the output of a model run, this prints out the top five highest-scoring
+// values using the labels loaded at init.
 Status LabelImage::PrintTopLabels(
                       const std::string image,
-                      const std::vector<Tensor>& outputs,
-                      const string& labels_file_name) {
-  std::vector<string> labels;
+                      const std::vector<Tensor>& outputs) {
   std::vector<string> topLabels;
   std::vector<float> topScores;
-  size_t label_count;
-  Status read_labels_status =
-      ReadLabelsFile(labels_file_name, &labels, &label_count);
-  if (!read_labels_status.ok()) {
-    LOG(ERROR) << read_labels_status;
-    return read_labels_status;
+  TF_RETURN_IF_ERROR(TopLabels(outputs, &topLabels, &topScores));
+  if (NULL != onLabel) {
+    onLabel (image, topLabels, topScores, onLabelThis);
   }
-  const int how_many_labels = std::min(5, static_cast<int>(label_count));
+  return Status::OK();
+}
+
+// The top five labels and their scores for a single row of model output.
+Status LabelImage::TopLabels(const std::vector<Tensor>& outputs,
+                             std::vector<string>* topLabels,
+                             std::vector<float>* topScores) {
+  const int how_many_labels = std::min(5, static_cast<int>(labelCount));
   Tensor indices;
   Tensor scores;
   TF_RETURN_IF_ERROR(GetTopLabels(outputs, how_many_labels, &indices, &scores));
@@ -229,11 +543,8 @@ Status LabelImage::PrintTopLabels(
     const float score = scores_flat(pos);
     // LOG(INFO) << labels[label_index] << " (" << label_index << "): " << score;
 
-    topLabels.push_back(labels[label_index]);
-    topScores.push_back(score);
-  }
-  if (NULL != onLabel) {
-    onLabel (image, topLabels, topScores, onLabelThis);
+    topLabels->push_back(labelNames[label_index]);
+    topScores->push_back(score);
   }
   return Status::OK();
 }
@@ -258,28 +569,130 @@ Status LabelImage::CheckTopLabel(const std::vector<Tensor>& outputs, int expecte
   return Status::OK();
 }
 
+// Logs allocation counts and resident memory every "stats.report-every"
+// processed images.
+void LabelImage::ReportStats() {
+  processed++;
+  if (config == NULL || config->getStatsReportEvery() <= 0 ||
+      processed % config->getStatsReportEvery() != 0) {
+    return;
+  }
+  tensorflow::AllocatorStats stats;
+  tensorflow::cpu_allocator()->GetStats(&stats);
+  tensorflow::uint64 arena_allocations = arena.allocations();
+  LOG(INFO) << "Processed " << processed << " images: " <<
+    (stats.num_allocs - statsAllocations) / config->getStatsReportEvery() <<
+    " allocations/image, " << (arena_allocations - statsArenaAllocations) <<
+    " arena allocations, " << arena.reuses() << " arena reuses, rss " <<
+    ResidentSetBytes() / (1024 * 1024) << " MB";
+  LOG(INFO) << "Admission: " << admitted << " admitted, " << reduced <<
+    " reduced, rejected " << rejectedUnsupported << " unsupported, " <<
+    rejectedCorrupt << " corrupt, " << rejectedTooLarge << " too large";
+  if (budget != NULL) {
+    LOG(INFO) << "Decode budget: " << budget->inUse() / (1024 * 1024) <<
+      " MB in use, " << budget->peak() / (1024 * 1024) << " MB peak of " <<
+      budget->budget() / (1024 * 1024) << " MB, " << budget->waits() <<
+      " waits";
+  }
+  // Share of wall time the model was running; the rest is spent waiting on
+  // reads, decode and everything upstream.
+  int64_t now = Trace::now();
+  LOG(INFO) << "Inference busy " << (now > statsReportUs ?
+    100.0 * (inferenceUs - statsInferenceUs) / (now - statsReportUs) : 0) <<
+    "% of the last " << (now - statsReportUs) / 1000 << " ms";
+  statsAllocations = stats.num_allocs;
+  statsArenaAllocations = arena_allocations;
+  statsInferenceUs = inferenceUs;
+  statsReportUs = now;
+}
+
 int LabelImage::process(string image) {
+  return process(image, tensorflow::io::JoinPath(root, image), NULL);
+}
+
+// Labels an image that is already in memory, such as an archive member. The
+// name is only used to report it.
+int LabelImage::processBuffer(string image, tensorflow::StringPiece contents) {
+  return process(image, image, &contents);
+}
+
+int LabelImage::process(const string& image, const string& image_path,
+                        const tensorflow::StringPiece* contents) {
+  TraceSpan process_span("process", image_path);
+
+  // Admission and the budget wait happen before mProcessLock, so callers
+  // queue on the budget rather than on the decoder while memory is short.
+  ImageInfo info;
+  int ratio = 1;
+  tensorflow::uint64 reserved = 0;
+  TraceSpan probe_span("probe", image_path);
+  Status admit_status =
+      Admit(image_path, contents, &info, &ratio, &reserved);
+  probe_span.end();
+  if (!admit_status.ok()) {
+    LOG(ERROR) << "Rejected: " << admit_status;
+    return -1;
+  }
+  CountAdmitted(ratio);
+
+  // Only the normalized output outlives the run, so the reservation covers
+  // just the read and decode.
+  if (budget != NULL) {
+    TraceSpan budget_span("budget-wait", image_path);
+    budget->acquire(reserved);
+  }
+
+  int64_t waiting = Trace::now();
+  std::lock_guard<std::mutex> lock(mProcessLock);
+  Trace::record("process-wait", image_path, waiting, Trace::now());
+
   // Get the image from disk as a float array of numbers, resized and normalized
   // to the specifications the main graph expects.
-  std::vector<Tensor> resized_tensors;
-  string image_path = tensorflow::io::JoinPath(root, image);
+  resizedTensors.clear();
   Status read_tensor_status =
-      ReadTensorFromImageFile(image_path, input_height, input_width, input_mean,
-                              input_std, &resized_tensors);
+      ReadTensorFromImageFile(image_path, contents, info, ratio,
+                              &resizedTensors);
+  if (budget != NULL) {
+    budget->release(reserved);
+  }
   if (!read_tensor_status.ok()) {
     LOG(ERROR) << read_tensor_status;
     return -1;
   }
-  const Tensor& resized_tensor = resized_tensors[0];
+
+  // Stage the image into the preallocated batch input, so the model is fed the
+  // same buffer on every run. Animated gifs come out with one row per sampled
+  // frame, and multi-crop images with one row per crop; either way they are
+  // run as a single batch.
+  const Tensor& resized_tensor = resizedTensors[0];
+  const int batch = resized_tensor.dim_size(0);
+  Tensor input_tensor = arena.input(batch, input_height, input_width, 3);
+  if (resized_tensor.NumElements() != input_tensor.NumElements()) {
+    LOG(ERROR) << "Unexpected preprocessed shape " <<
+      resized_tensor.shape().DebugString();
+    return -1;
+  }
+  std::copy_n(resized_tensor.flat<float>().data(),
+              resized_tensor.NumElements(), input_tensor.flat<float>().data());
+  resizedTensors.clear();
 
   // Actually run the image through the model.
-  std::vector<Tensor> outputs;
-  Status run_status = session->Run({{input_layer, resized_tensor}},
+  outputs.clear();
+  TraceSpan inference_span("inference", image_path);
+  int64_t inference_start = Trace::now();
+  Status run_status = session->Run({{input_layer, input_tensor}},
                                    {output_layer}, {}, &outputs);
+  inferenceUs += Trace::now() - inference_start;
+  inference_span.end();
   if (!run_status.ok()) {
     LOG(ERROR) << "Running model failed: " << run_status;
     return -1;
   }
+  if (batch > 1) {
+    Tensor aggregated;
+    AggregateBatch(outputs[0], MeanAggregate(info.format), &aggregated);
+    outputs.assign(1, aggregated);
+  }
 
   // This is for automated testing to make sure we get the expected result with
   // the default settings. We know that label 653 (military uniform) should be
@@ -298,10 +711,280 @@ int LabelImage::process(string image) {
   }
 
   // Do something interesting with the results we've generated.
-  Status print_status = PrintTopLabels(image, outputs, labels);
+  TraceSpan labels_span("top-labels", image_path);
+  Status print_status = PrintTopLabels(image, outputs);
+  labels_span.end();
+  outputs.clear();
   if (!print_status.ok()) {
     LOG(ERROR) << "Running print failed: " << print_status;
     return -1;
   }
+  ReportStats();
   return 0;
 }
+
+int LabelImage::processBatch(std::vector<BatchImage>* images) {
+  // Every image is admitted up front, outside mProcessLock. Preprocessing is
+  // still one image at a time, so the batch only ever holds the largest of
+  // the reservations its caller doesn't already hold; only inference is
+  // shared.
+  std::vector<ImageInfo> infos(images->size());
+  std::vector<int> ratios(images->size(), 1);
+  tensorflow::uint64 reserved = 0;
+  for (size_t pos = 0; pos < images->size(); ++pos) {
+    BatchImage& image = (*images)[pos];
+    image.labels.clear();
+    image.scores.clear();
+    const tensorflow::StringPiece* contents =
+        image.contents.data() != NULL ? &image.contents : NULL;
+    string image_path = contents != NULL ? image.name :
+        tensorflow::io::JoinPath(root, image.name);
+    tensorflow::uint64 image_reserved = 0;
+    TraceSpan probe_span("probe", image.name);
+    image.status = Admit(image_path, contents, &infos[pos], &ratios[pos],
+                         &image_reserved);
+    probe_span.end();
+    if (!image.status.ok()) {
+      LOG(ERROR) << "Rejected: " << image.status;
+      continue;
+    }
+    CountAdmitted(ratios[pos]);
+    if (image.reserved == 0) {
+      reserved = std::max(reserved, image_reserved);
+    }
+  }
+  if (budget != NULL && reserved > 0) {
+    TraceSpan budget_span("budget-wait", (*images)[0].name);
+    budget->acquire(reserved);
+  }
+
+  int64_t waiting = Trace::now();
+  std::lock_guard<std::mutex> lock(mProcessLock);
+
+  const tensorflow::int64 row_elements = input_height * input_width * 3;
+  std::vector<ImageFormat> formats(images->size(), IMAGE_FORMAT_UNKNOWN);
+  batchTensors.clear();
+  batchRows.assign(images->size(), 0);
+  int rows = 0;
+  for (size_t pos = 0; pos < images->size(); ++pos) {
+    BatchImage& image = (*images)[pos];
+    Trace::record("process-wait", image.name, waiting, Trace::now());
+    if (!image.status.ok()) {
+      continue;
+    }
+    const tensorflow::StringPiece* contents =
+        image.contents.data() != NULL ? &image.contents : NULL;
+    string image_path = contents != NULL ? image.name :
+        tensorflow::io::JoinPath(root, image.name);
+    const ImageInfo& info = infos[pos];
+    resizedTensors.clear();
+    image.status = ReadTensorFromImageFile(image_path, contents, info,
+                                           ratios[pos], &resizedTensors);
+    if (image.status.ok() && resizedTensors[0].NumElements() !=
+        resizedTensors[0].dim_size(0) * row_elements) {
+      image.status = tensorflow::errors::Internal(
+          "Unexpected preprocessed shape ",
+          resizedTensors[0].shape().DebugString());
+    }
+    if (!image.status.ok()) {
+      LOG(ERROR) << image.status;
+      continue;
+    }
+    batchTensors.push_back(resizedTensors[0]);
+    batchRows[pos] = resizedTensors[0].dim_size(0);
+    formats[pos] = info.format;
+    rows += batchRows[pos];
+  }
+  resizedTensors.clear();
+  if (budget != NULL && reserved > 0) {
+    budget->release(reserved);
+  }
+  if (rows == 0) {
+    return 0;
+  }
+
+  Tensor input_tensor = arena.input(rows, input_height, input_width, 3);
+  float* staged = input_tensor.flat<float>().data();
+  for (auto& tensor : batchTensors) {
+    staged = std::copy_n(tensor.flat<float>().data(), tensor.NumElements(),
+                         staged);
+  }
+  batchTensors.clear();
+
+  outputs.clear();
+  int64_t inference_start = Trace::now();
+  Status run_status = session->Run({{input_layer, input_tensor}},
+                                   {output_layer}, {}, &outputs);
+  int64_t inference_end = Trace::now();
+  inferenceUs += inference_end - inference_start;
+  if (!run_status.ok()) {
+    LOG(ERROR) << "Running model failed: " << run_status;
+  }
+
+  // Each image owns a run of rows in the shared output: one row, or one per
+  // gif frame or crop, merged the same way as for a single image.
+  int labeled = 0;
+  tensorflow::int64 row = 0;
+  for (size_t pos = 0; pos < images->size(); ++pos) {
+    if (batchRows[pos] == 0) {
+      continue;
+    }
+    BatchImage& image = (*images)[pos];
+    if (!run_status.ok()) {
+      image.status = run_status;
+      continue;
+    }
+    Trace::record("inference", image.name, inference_start, inference_end);
+    Tensor image_scores;
+    AggregateBatch(outputs[0].Slice(row, row + batchRows[pos]),
+                   MeanAggregate(formats[pos]), &image_scores);
+    row += batchRows[pos];
+
+    if (self_test) {
+      bool expected_matches;
+      image.status = CheckTopLabel(std::vector<Tensor>(1, image_scores), 653,
+                                   &expected_matches);
+      if (!image.status.ok()) {
+        LOG(ERROR) << "Running check failed: " << image.status;
+        continue;
+      }
+      if (!expected_matches) {
+        LOG(ERROR) << "Self-test failed!";
+        image.status = tensorflow::errors::Internal(image.name,
+            ": self-test failed");
+        continue;
+      }
+    }
+
+    TraceSpan labels_span("top-labels", image.name);
+    image.status = TopLabels(std::vector<Tensor>(1, image_scores),
+                             &image.labels, &image.scores);
+    labels_span.end();
+    if (image.status.ok()) {
+      labeled++;
+      if (NULL != onLabel) {
+        onLabel (image.name, image.labels, image.scores, onLabelThis);
+      }
+    }
+    ReportStats();
+  }
+  outputs.clear();
+  return labeled;
+}
+
+// Runs synthetic inputs through every graph so that TensorFlow's lazy
+// initialization happens here rather than on the first real images: a small
+// encoded jpeg and png through the plain and multi-crop preprocessing, a one
+// frame gif through the gif branch, then zeros through the model and top-k at
+// each batch size the model will be fed.
+int LabelImage::warmUp(const std::vector<int>& batch_sizes) {
+  std::lock_guard<std::mutex> lock(mProcessLock);
+  if (session == nullptr || preprocessSession == nullptr) {
+    LOG(ERROR) << "Warm-up without a loaded model";
+    return -1;
+  }
+  auto root = tensorflow::Scope::NewRootScope();
+  using namespace ::tensorflow::ops;  // NOLINT(build/namespaces)
+
+  Tensor pixels(tensorflow::DT_UINT8, tensorflow::TensorShape(
+      {kWarmUpImageSize, kWarmUpImageSize, 3}));
+  pixels.flat<tensorflow::uint8>().setConstant(128);
+  auto image = Const(root.WithOpName("pixels"),
+                     tensorflow::Input::Initializer(pixels));
+  EncodeJpeg(root.WithOpName("jpeg"), image);
+  EncodePng(root.WithOpName("png"), image);
+
+  tensorflow::GraphDef graph;
+  std::vector<Tensor> encoded;
+  std::unique_ptr<tensorflow::Session> encode_session(
+      tensorflow::NewSession(tensorflow::SessionOptions()));
+  Status encode_status = root.ToGraphDef(&graph);
+  if (encode_status.ok()) {
+    encode_status = encode_session->Create(graph);
+  }
+  if (encode_status.ok()) {
+    encode_status = encode_session->Run({}, {"jpeg", "png"}, {}, &encoded);
+  }
+  if (!encode_status.ok()) {
+    LOG(ERROR) << "Warm-up encode failed: " << encode_status;
+    return -1;
+  }
+
+  // TensorFlow has no gif encoder; this is the smallest valid gif.
+  static const char kWarmUpGif[] =
+      "GIF89a\x01\x00\x01\x00\x80\x00\x00\xff\xff\xff\x00\x00\x00"
+      "!\xf9\x04\x01\x00\x00\x00\x00,\x00\x00\x00\x00\x01\x00\x01"
+      "\x00\x00\x02\x02" "D\x01\x00;";
+  Tensor frame_indices(tensorflow::DT_INT32, tensorflow::TensorShape({1}));
+  frame_indices.flat<int32>().setZero();
+
+  // Crops as the configured multi-crop mode would cut them.
+  ImageInfo info = {IMAGE_FORMAT_JPEG, kWarmUpImageSize, kWarmUpImageSize, 1,
+                    1, 0};
+  std::vector<float> boxes = config != NULL ? CropBoxes(info) :
+      std::vector<float>({0.0f, 0.0f, 1.0f, 1.0f});
+  const tensorflow::int64 count = boxes.size() / 4;
+  Tensor crop_boxes(tensorflow::DT_FLOAT, tensorflow::TensorShape({count, 4}));
+  std::copy(boxes.begin(), boxes.end(), crop_boxes.flat<float>().data());
+  Tensor crop_box_indices(tensorflow::DT_INT32,
+                          tensorflow::TensorShape({count}));
+  crop_box_indices.flat<int32>().setZero();
+
+  struct Branch {
+    string output;
+    string contents;
+    std::vector<std::pair<string, Tensor>> feeds;
+  };
+  const string jpeg = encoded[0].scalar<string>()();
+  const string png = encoded[1].scalar<string>()();
+  const std::vector<Branch> branches = {
+    {"normalized_jpeg", jpeg, {}},
+    {"normalized_png", png, {}},
+    {"normalized_gif", string(kWarmUpGif, sizeof(kWarmUpGif) - 1),
+     {{"frame_indices", frame_indices}}},
+    {"cropped_jpeg", jpeg,
+     {{"crop_boxes", crop_boxes}, {"crop_box_indices", crop_box_indices}}},
+    {"cropped_png", png,
+     {{"crop_boxes", crop_boxes}, {"crop_box_indices", crop_box_indices}}},
+  };
+  for (const Branch& branch : branches) {
+    Tensor& contents = arena.contents();
+    contents.scalar<string>()() = branch.contents;
+    std::vector<std::pair<string, Tensor>> inputs = {{"input", contents}};
+    inputs.insert(inputs.end(), branch.feeds.begin(), branch.feeds.end());
+    resizedTensors.clear();
+    Status run_status = preprocessSession->Run(inputs, {branch.output}, {},
+                                               &resizedTensors);
+    if (!run_status.ok()) {
+      LOG(ERROR) << "Warm-up " << branch.output << " failed: " << run_status;
+      return -1;
+    }
+  }
+  resizedTensors.clear();
+
+  for (int batch : batch_sizes) {
+    Tensor input_tensor = arena.input(batch, input_height, input_width, 3);
+    input_tensor.flat<float>().setZero();
+    outputs.clear();
+    Status run_status = session->Run({{input_layer, input_tensor}},
+                                     {output_layer}, {}, &outputs);
+    if (run_status.ok()) {
+      Tensor indices;
+      Tensor scores;
+      run_status = GetTopLabels(outputs, std::min(5, static_cast<int>(labelCount)),
+                                &indices, &scores);
+    }
+    outputs.clear();
+    if (!run_status.ok()) {
+      LOG(ERROR) << "Warm-up at batch " << batch << " failed: " << run_status;
+      return -1;
+    }
+    LOG(INFO) << "Warmed up batch size " << batch;
+  }
+  return 0;
+}
+
+void LabelImage::setMultiCrop(bool enabled) {
+  std::lock_guard<std::mutex> lock(mProcessLock);
+  multiCrop = enabled;
+}
@@ -1,5 +1,8 @@
 
 
+#include <map>
+#include <mutex>
+#include <atomic>
 #include <fstream>
 #include <utility>
 #include <vector>
@@ -15,6 +18,7 @@
 #include "tensorflow/core/lib/core/stringpiece.h"
 #include "tensorflow/core/lib/core/threadpool.h"
 #include "tensorflow/core/lib/io/path.h"
+#include "tensorflow/core/lib/strings/strcat.h"
 #include "tensorflow/core/lib/strings/stringprintf.h"
 #include "tensorflow/core/platform/env.h"
 #include "tensorflow/core/platform/init_main.h"
@@ -23,6 +27,12 @@
 #include "tensorflow/core/public/session.h"
 #include "tensorflow/core/util/command_line_flags.h"
 
+#include "config.h"
+#include "image-probe.h"
+#include "tensor-arena.h"
+#include "decode-budget.h"
+#include "trace.h"
+
 // These are all common classes it's handy to reference with no namespace.
 using tensorflow::Flag;
 using tensorflow::Tensor;
@@ -30,11 +40,30 @@ using tensorflow::Status;
 using tensorflow::string;
 using tensorflow::int32;
 
+// One image of a processBatch() call. Images without contents are read from
+// the name as a path under root. reserved is decode budget the caller
+// already holds for the image, which processBatch() then doesn't reserve
+// again. The labels, or the reason there are none, are filled in on return.
+struct BatchImage {
+  string name;
+  tensorflow::StringPiece contents;
+  tensorflow::uint64 reserved = 0;
+  Status status;
+  std::vector<string> labels;
+  std::vector<float> scores;
+};
+
 typedef void (*OnLabel) (std::string image, std::vector<std::string> labels, std::vector<float> scores, void *this_);
 
 class LabelImage {
 private:
+  friend class LabelImageTest;
+
+  Config *config;
+  DecodeBudget *budget;
   std::unique_ptr<tensorflow::Session> session;
+  std::unique_ptr<tensorflow::Session> preprocessSession;
+  std::unique_ptr<tensorflow::Session> topKSession;
   string root;
   string graph;
   int32 input_width;
@@ -44,20 +73,61 @@ private:
   string input_layer;
   string output_layer;
   bool self_test;
+  bool multiCrop;
   string labels;
+  std::vector<string> labelNames;
+  size_t labelCount;
   OnLabel onLabel;
   void *onLabelThis;
 
+  // Everything below is reused from one image to the next; process() holds
+  // mProcessLock while touching any of it.
+  std::mutex mProcessLock;
+  TensorArena arena;
+  std::map<int, Tensor> topKCounts;
+  std::vector<Tensor> resizedTensors;
+  std::vector<Tensor> batchTensors;
+  std::vector<int> batchRows;
+  std::vector<Tensor> outputs;
+  std::vector<Tensor> topKTensors;
+  tensorflow::uint64 processed;
+  tensorflow::int64 statsAllocations;
+  tensorflow::uint64 statsArenaAllocations;
+  tensorflow::int64 inferenceUs;
+  tensorflow::int64 statsInferenceUs;
+  tensorflow::int64 statsReportUs;
+  // Admission runs before mProcessLock is taken.
+  std::atomic<tensorflow::uint64> admitted;
+  std::atomic<tensorflow::uint64> reduced;
+  std::atomic<tensorflow::uint64> rejectedUnsupported;
+  std::atomic<tensorflow::uint64> rejectedCorrupt;
+  std::atomic<tensorflow::uint64> rejectedTooLarge;
+
   Status LoadGraph(const string& graph_file_name,
         std::unique_ptr<tensorflow::Session>* session);
+  Status BuildPreprocessGraph(const int input_height,
+        const int input_width,
+        const float input_mean,
+        const float input_std,
+        std::unique_ptr<tensorflow::Session>* session);
+  Status BuildTopKGraph(std::unique_ptr<tensorflow::Session>* session);
   Status ReadEntireFile(tensorflow::Env* env,
         const string& filename,
         Tensor* output);
+  std::vector<int32> SampleFrames(int frames);
+  std::vector<float> CropBoxes(const ImageInfo& info);
+  bool MeanAggregate(ImageFormat format);
+  Status AggregateBatch(const Tensor& batch_scores, bool mean, Tensor* scores);
+  Status Admit(const string& file_name,
+        const tensorflow::StringPiece* contents,
+        ImageInfo* info,
+        int* ratio,
+        tensorflow::uint64* reserved);
+  void CountAdmitted(int ratio);
   Status ReadTensorFromImageFile(const string& file_name,
-        const int input_height,
-        const int input_width,
-        const float input_mean,
-        const float input_std,
+        const tensorflow::StringPiece* contents,
+        const ImageInfo& info,
+        const int ratio,
         std::vector<Tensor>* out_tensors);
   Status ReadLabelsFile(const string& file_name,
         std::vector<string>* result,
@@ -67,15 +137,33 @@ private:
         Tensor* indices, Tensor* scores);
   Status PrintTopLabels(
         const std::string image,
-        const std::vector<Tensor>& outputs,
-        const string& labels_file_name);
+        const std::vector<Tensor>& outputs);
+  Status TopLabels(const std::vector<Tensor>& outputs,
+        std::vector<string>* topLabels,
+        std::vector<float>* topScores);
   Status CheckTopLabel(const std::vector<Tensor>& outputs,
         int expected,
         bool* is_expected);
+  void ReportStats();
+  int process(const string& image,
+        const string& image_path,
+        const tensorflow::StringPiece* contents);
 public:
-  LabelImage();
+  LabelImage(Config *config, DecodeBudget *budget);
   LabelImage(string root, string graph);
   ~LabelImage();
   int init(OnLabel onLabel, void *this_);
+  int warmUp(const std::vector<int>& batch_sizes);
+  void setMultiCrop(bool enabled);
   int process(string image);
+  int processBuffer(string image, tensorflow::StringPiece contents);
+  // Checks an image against the decode limits from its header alone, for
+  // callers that reserve decode budget before handing it to processBatch().
+  // Rejections are logged and counted as process() would. Returns 0 with the
+  // bytes to reserve, or -1.
+  int admit(string image, tensorflow::uint64* reserved);
+  // Decodes every image on its own, then runs them all through the model as
+  // one batch. Labels go to OnLabel as well as into images. Returns the
+  // number of images labeled.
+  int processBatch(std::vector<BatchImage>* images);
 };
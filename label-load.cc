@@ -0,0 +1,196 @@
+// Load generator for the label server. Runs closed-loop clients against
+// "--server" mode at each concurrency level in turn, each client sending the
+// same images back to back, and prints requests/sec against p50 and p99
+// latency per level:
+//
+//   ch-tf-label-load --concurrency=1,4,16,64 --seconds=10 grace_hopper.jpg
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Level {
+  std::mutex lock;
+  std::vector<double> latenciesMs;
+  uint64_t errors;
+};
+
+static bool ReadFully(int fd, char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t done = read(fd, buffer, length);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    buffer += done;
+    length -= done;
+  }
+  return true;
+}
+
+static bool WriteFully(int fd, const char *buffer, size_t length) {
+  while (length > 0) {
+    // A peer that has gone away fails the send with EPIPE rather than raising
+    // SIGPIPE, which would end the process.
+    ssize_t done = send(fd, buffer, length, MSG_NOSIGNAL);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    buffer += done;
+    length -= done;
+  }
+  return true;
+}
+
+static int Connect(const std::string &host, int port) {
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  inet_pton(AF_INET, host.c_str(), &address.sin_addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  return fd;
+}
+
+static void Client(const std::string &host, int port,
+                   const std::vector<std::string> &images,
+                   Clock::time_point end, Level *level) {
+  std::vector<double> latencies;
+  uint64_t errors = 0;
+  int fd = Connect(host, port);
+  std::string response;
+  for (size_t pos = 0; fd >= 0 && Clock::now() < end; ++pos) {
+    const std::string &image = images[pos % images.size()];
+    Clock::time_point start = Clock::now();
+    uint32_t length = htonl(image.length());
+    if (!WriteFully(fd, (const char *) &length, sizeof(length)) ||
+        !WriteFully(fd, image.data(), image.length()) ||
+        !ReadFully(fd, (char *) &length, sizeof(length))) {
+      errors++;
+      break;
+    }
+    response.resize(ntohl(length));
+    if (!ReadFully(fd, &response[0], response.length())) {
+      errors++;
+      break;
+    }
+    if (response.find("\"error\"") != std::string::npos) {
+      errors++;
+      continue;
+    }
+    latencies.push_back(std::chrono::duration<double, std::milli>(
+        Clock::now() - start).count());
+  }
+  if (fd < 0) {
+    errors++;
+  } else {
+    close(fd);
+  }
+
+  std::lock_guard<std::mutex> lock(level->lock);
+  level->latenciesMs.insert(level->latenciesMs.end(), latencies.begin(),
+                            latencies.end());
+  level->errors += errors;
+}
+
+static double Percentile(const std::vector<double> &sorted, double fraction) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = (size_t) (fraction * (sorted.size() - 1));
+  return sorted[index];
+}
+
+int main(int argc, char *argv[]) {
+  std::string host = "127.0.0.1";
+  int port = 9870;
+  int seconds = 10;
+  std::vector<int> concurrency = {1, 2, 4, 8, 16, 32};
+  std::vector<std::string> images;
+
+  for (int arg = 1; arg < argc; ++arg) {
+    std::string flag = argv[arg];
+    std::string value = flag.substr(flag.find('=') + 1);
+    if (flag.compare(0, 7, "--host=") == 0) {
+      host = value;
+    } else if (flag.compare(0, 7, "--port=") == 0) {
+      port = atoi(value.c_str());
+    } else if (flag.compare(0, 10, "--seconds=") == 0) {
+      seconds = atoi(value.c_str());
+    } else if (flag.compare(0, 14, "--concurrency=") == 0) {
+      concurrency.clear();
+      std::stringstream levels(value);
+      std::string item;
+      while (std::getline(levels, item, ',')) {
+        concurrency.push_back(atoi(item.c_str()));
+      }
+    } else {
+      std::ifstream file(flag, std::ios::binary);
+      if (!file) {
+        fprintf(stderr, "Unable to read %s\n", flag.c_str());
+        return -1;
+      }
+      images.emplace_back(std::istreambuf_iterator<char>(file),
+                          std::istreambuf_iterator<char>());
+    }
+  }
+  if (images.empty()) {
+    fprintf(stderr, "usage: %s [--host=] [--port=] [--seconds=] "
+            "[--concurrency=1,2,4] image...\n", argv[0]);
+    return -1;
+  }
+
+  printf("%12s %12s %10s %10s %10s\n", "concurrency", "requests/s", "p50 ms",
+         "p99 ms", "errors");
+  for (int clients : concurrency) {
+    Level level;
+    level.errors = 0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point end = start + std::chrono::seconds(seconds);
+    std::vector<std::thread> threads;
+    for (int client = 0; client < clients; ++client) {
+      threads.emplace_back(Client, host, port, std::cref(images), end, &level);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    std::sort(level.latenciesMs.begin(), level.latenciesMs.end());
+    printf("%12d %12.1f %10.2f %10.2f %10llu\n", clients,
+           level.latenciesMs.size() / elapsed,
+           Percentile(level.latenciesMs, 0.50),
+           Percentile(level.latenciesMs, 0.99),
+           (unsigned long long) level.errors);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,112 @@
+#include <string>
+#include <csignal>
+#include <cstring>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "label-server.h"
+
+namespace {
+
+int Connect(int port) {
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void Send(int fd, uint32_t declared, const std::string &payload) {
+  uint32_t length = htonl(declared);
+  ASSERT_EQ(4, send(fd, &length, sizeof(length), MSG_NOSIGNAL));
+  ASSERT_EQ((ssize_t) payload.size(),
+            send(fd, payload.data(), payload.size(), MSG_NOSIGNAL));
+}
+
+// One request on a new connection, returning the response or "" if there
+// was none.
+std::string Request(int port, const std::string &payload) {
+  int fd = Connect(port);
+  if (fd < 0) {
+    return "";
+  }
+  Send(fd, payload.size(), payload);
+  std::string response;
+  uint32_t length = 0;
+  if (recv(fd, &length, sizeof(length), MSG_WAITALL) == sizeof(length)) {
+    response.resize(ntohl(length));
+    if (recv(fd, &response[0], response.size(), MSG_WAITALL) !=
+        (ssize_t) response.size()) {
+      response.clear();
+    }
+  }
+  close(fd);
+  return response;
+}
+
+// A server on a free port with a model that is never loaded. Everything the
+// tests send is refused at admission, so nothing reaches inference. The
+// server's threads run for the life of the process, so it is never deleted.
+LabelServer *StartServer(const std::string &name) {
+  Config *config = LoadTestConfig(name, {
+    {"server", {
+      {"port", 0},
+      {"max-connections", 4},
+      {"max-batch", 4},
+      {"batch-deadline-ms", 20}
+    }}
+  });
+  DecodeBudget *budget = new DecodeBudget(config->getDecodeMemoryBudgetBytes());
+  LabelServer *server = new LabelServer(config, NULL);
+  EXPECT_EQ(0, server->start(new LabelImage(config, budget)));
+  return server;
+}
+
+TEST(LabelServerTest, AnswersEveryRequest) {
+  LabelServer *server = StartServer("label-server-answers");
+  std::string response = Request(server->port(), "not an image");
+  EXPECT_NE(std::string::npos, response.find("\"error\"")) << response;
+}
+
+TEST(LabelServerTest, KeepsServingWhenClientsCloseMidRequest) {
+  // The default, so a write to a closed connection would end the test.
+  signal(SIGPIPE, SIG_DFL);
+  LabelServer *server = StartServer("label-server-dropped");
+  int port = server->port();
+
+  // More than max-connections of each, so the slots must be given back too.
+  for (int client = 0; client < 8; ++client) {
+    // Gone before the batch deadline is up and the response is written.
+    int fd = Connect(port);
+    ASSERT_GE(fd, 0);
+    Send(fd, 12, "not an image");
+    close(fd);
+  }
+  for (int client = 0; client < 8; ++client) {
+    // Gone halfway through the request.
+    int fd = Connect(port);
+    ASSERT_GE(fd, 0);
+    Send(fd, 100, "not an");
+    close(fd);
+  }
+
+  std::string response;
+  EXPECT_TRUE(WaitFor([port, &response] {
+    response = Request(port, "not an image");
+    return response.find("too many connections") == std::string::npos &&
+      !response.empty();
+  }, 5000)) << response;
+  EXPECT_NE(std::string::npos, response.find("\"error\"")) << response;
+}
+
+}  // namespace
@@ -0,0 +1,320 @@
+#include <thread>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <glog/logging.h>
+
+#include "label-server.h"
+
+using ChCppUtils::ThreadJob;
+
+// Reads or writes exactly length bytes, or fails.
+static bool ReadFully(int fd, char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t done = read(fd, buffer, length);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    buffer += done;
+    length -= done;
+  }
+  return true;
+}
+
+static bool WriteFully(int fd, const char *buffer, size_t length) {
+  while (length > 0) {
+    // A peer that has gone away fails the send with EPIPE rather than raising
+    // SIGPIPE, which would end the process.
+    ssize_t done = send(fd, buffer, length, MSG_NOSIGNAL);
+    if (done < 0 && errno == EINTR) {
+      continue;
+    }
+    if (done <= 0) {
+      return false;
+    }
+    buffer += done;
+    length -= done;
+  }
+  return true;
+}
+
+static bool WriteFrame(int fd, const std::string &payload) {
+  uint32_t length = htonl(payload.length());
+  return WriteFully(fd, (const char *) &length, sizeof(length)) &&
+    WriteFully(fd, payload.data(), payload.length());
+}
+
+LabelServer::LabelServer(Config *config, StartupReport *startup) {
+  this->config = config;
+  this->startup = startup;
+  decodeBudget = NULL;
+  labelImage = NULL;
+  listenFd = -1;
+  mAcceptPool = NULL;
+  mConnectionPool = NULL;
+  mBatchPool = NULL;
+  mConnections = 0;
+  mRequests = 0;
+  mBatches = 0;
+  mRejected = 0;
+  mDropped = 0;
+  mNextRequest = 0;
+  mLastReportUs = 0;
+}
+
+LabelServer::~LabelServer() {
+  if (listenFd >= 0) {
+    close(listenFd);
+  }
+}
+
+int LabelServer::init() {
+  int status = 0;
+  startup->time("load-graph", [this, &status] {
+    decodeBudget = new DecodeBudget(config->getDecodeMemoryBudgetBytes());
+    labelImage = new LabelImage(config, decodeBudget);
+    status = labelImage->init(NULL, NULL);
+  });
+  if (status != 0) {
+    LOG(ERROR) << "Failed to initialize the model";
+    return -1;
+  }
+  startup->time("warm-up", [this, &status] {
+    status = labelImage->warmUp(config->getWarmUpBatchSizes());
+  });
+  if (status != 0) {
+    LOG(ERROR) << "Failed to warm up the model";
+    return -1;
+  }
+  if (start(labelImage) != 0) {
+    return -1;
+  }
+  startup->log();
+  return 0;
+}
+
+int LabelServer::start(LabelImage *labelImage) {
+  this->labelImage = labelImage;
+  struct sockaddr_in address;
+  memset(&address, 0x00, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(config->getServerPort());
+  if (inet_pton(AF_INET, config->getServerBind().c_str(),
+                &address.sin_addr) != 1) {
+    LOG(ERROR) << "Bad server.bind address: " << config->getServerBind();
+    return -1;
+  }
+  listenFd = socket(AF_INET, SOCK_STREAM, 0);
+  int reuse = 1;
+  if (listenFd < 0 ||
+      setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                 sizeof(reuse)) != 0 ||
+      bind(listenFd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+      listen(listenFd, 128) != 0) {
+    LOG(ERROR) << "Unable to listen on " << config->getServerBind() << ":" <<
+      config->getServerPort();
+    return -1;
+  }
+
+  mConnectionPool = new ThreadPool (config->getServerMaxConnections(), false);
+  mBatchPool = new ThreadPool (1, false);
+  mBatchPool->addJob(new ThreadJob (LabelServer::_batchRoutine, this));
+  mAcceptPool = new ThreadPool (1, false);
+  mAcceptPool->addJob(new ThreadJob (LabelServer::_acceptRoutine, this));
+  LOG(INFO) << "Label server listening on " << config->getServerBind() << ":" <<
+    port();
+  return 0;
+}
+
+int LabelServer::port() {
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (listenFd < 0 ||
+      getsockname(listenFd, (struct sockaddr *) &address, &length) != 0) {
+    return -1;
+  }
+  return ntohs(address.sin_port);
+}
+
+void LabelServer::run() {
+  std::chrono::milliseconds ms(1000);
+  while (true) {
+     std::this_thread::sleep_for(ms);
+  }
+}
+
+void * LabelServer::_acceptRoutine (void *arg, struct event_base *base) {
+  LabelServer *server = (LabelServer *) arg;
+  return server->acceptRoutine();
+}
+
+// Every connection holds one thread of the connection pool for as long as it
+// stays open, so connections beyond "server.max-connections" are refused
+// rather than left waiting for a thread.
+void *LabelServer::acceptRoutine () {
+  while (true) {
+    int fd = accept(listenFd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    if (mConnections >= config->getServerMaxConnections()) {
+      WriteFrame(fd, "{\"error\":\"too many connections\"}");
+      close(fd);
+      continue;
+    }
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    mConnections++;
+    Connection *connection = new Connection();
+    connection->server = this;
+    connection->fd = fd;
+    mConnectionPool->addJob(
+      new ThreadJob (LabelServer::_connectionRoutine, connection));
+  }
+  return NULL;
+}
+
+void * LabelServer::_connectionRoutine (void *arg, struct event_base *base) {
+  Connection *connection = (Connection *) arg;
+  LabelServer *server = connection->server;
+  int fd = connection->fd;
+  delete connection;
+  return server->connectionRoutine(fd);
+}
+
+void *LabelServer::connectionRoutine (int fd) {
+  uint64_t max_request = config->getServerMaxRequestBytes();
+  Request request;
+  while (true) {
+    uint32_t length = 0;
+    if (!ReadFully(fd, (char *) &length, sizeof(length))) {
+      break;
+    }
+    length = ntohl(length);
+    if (length == 0 || length > max_request) {
+      WriteFrame(fd, "{\"error\":\"bad request length\"}");
+      break;
+    }
+    request.contents.resize(length);
+    if (!ReadFully(fd, &request.contents[0], length)) {
+      break;
+    }
+    label(&request);
+    if (!WriteFrame(fd, respond(request))) {
+      // The client closed before its response; only this connection ends.
+      mDropped++;
+      break;
+    }
+  }
+  close(fd);
+  mConnections--;
+  return NULL;
+}
+
+// Queues the request for the batcher and waits for it to be labeled.
+void LabelServer::label(Request *request) {
+  request->receivedUs = Trace::now();
+  request->done = false;
+  request->image.name = "request-" + std::to_string(mNextRequest++);
+  request->image.contents = tensorflow::StringPiece(request->contents);
+
+  std::unique_lock<std::mutex> lock(mLock);
+  mQueue.push_back(request);
+  mQueued.notify_one();
+  mDone.wait(lock, [request] { return request->done; });
+}
+
+std::string LabelServer::respond(const Request &request) {
+  json response;
+  if (!request.image.status.ok()) {
+    response["error"] = request.image.status.ToString();
+    return response.dump();
+  }
+  response["labels"] = request.image.labels;
+  response["scores"] = request.image.scores;
+  return response.dump();
+}
+
+void * LabelServer::_batchRoutine (void *arg, struct event_base *base) {
+  LabelServer *server = (LabelServer *) arg;
+  return server->batchRoutine();
+}
+
+void *LabelServer::batchRoutine () {
+  std::vector<Request *> batch;
+  std::vector<BatchImage> images;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mLock);
+      mQueued.wait(lock, [this] { return !mQueue.empty(); });
+      // The deadline runs from when the oldest request arrived, so a request
+      // never waits more than the deadline for others to join it.
+      size_t max_batch = std::max(1, config->getServerMaxBatch());
+      int64_t deadline = mQueue.front()->receivedUs +
+        config->getServerBatchDeadlineMs() * 1000LL;
+      while (mQueue.size() < max_batch && Trace::now() < deadline) {
+        mQueued.wait_for(lock,
+          std::chrono::microseconds(deadline - Trace::now()));
+      }
+      size_t take = std::min(max_batch, mQueue.size());
+      batch.assign(mQueue.begin(), mQueue.begin() + take);
+      mQueue.erase(mQueue.begin(), mQueue.begin() + take);
+    }
+
+    images.clear();
+    for (Request *request : batch) {
+      images.push_back(request->image);
+    }
+    labelImage->processBatch(&images);
+
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      for (size_t pos = 0; pos < batch.size(); ++pos) {
+        batch[pos]->image = images[pos];
+        batch[pos]->done = true;
+      }
+      report(batch);
+      mDone.notify_all();
+    }
+  }
+  return NULL;
+}
+
+// Called with mLock held. Logs request rate, batch size and latency every ten
+// seconds.
+void LabelServer::report(const std::vector<Request *> &batch) {
+  int64_t now = Trace::now();
+  mBatches++;
+  for (Request *request : batch) {
+    mRequests++;
+    if (!request->image.status.ok()) {
+      mRejected++;
+    }
+    mLatenciesUs.push_back(now - request->receivedUs);
+  }
+  if (mLastReportUs == 0) {
+    mLastReportUs = now;
+  }
+  if (now - mLastReportUs < 10000000LL || mLatenciesUs.empty()) {
+    return;
+  }
+  std::sort(mLatenciesUs.begin(), mLatenciesUs.end());
+  size_t p99 = std::min(mLatenciesUs.size() - 1, mLatenciesUs.size() * 99 / 100);
+  LOG(INFO) << "Server: " << mRequests * 1e6 / (now - mLastReportUs) <<
+    " requests/sec, " << (double) mRequests / mBatches << " per batch, p50 " <<
+    mLatenciesUs[mLatenciesUs.size() / 2] / 1000.0 << " ms, p99 " <<
+    mLatenciesUs[p99] / 1000.0 << " ms, " << mRejected << " rejected, " <<
+    mDropped << " dropped, " << mConnections << " connections";
+  mLatenciesUs.clear();
+  mRequests = 0;
+  mBatches = 0;
+  mLastReportUs = now;
+}
@@ -0,0 +1,95 @@
+#ifndef SRC_LABEL_SERVER_H_
+#define SRC_LABEL_SERVER_H_
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <condition_variable>
+#include <event2/event.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+#include <ch-cpp-utils/third-party/json/json.hpp>
+
+#include "config.h"
+#include "label-image.h"
+#include "decode-budget.h"
+#include "startup-report.h"
+
+using ChCppUtils::ThreadPool;
+
+using json = nlohmann::json;
+
+// Labels images sent by other services over a local socket. Every request and
+// response is a 4 byte big endian length followed by that many bytes: the
+// encoded image going in, a json object with "labels" and "scores" (or
+// "error") coming out. A connection may send any number of requests, one at a
+// time.
+//
+// Requests from all connections go onto one queue. The batcher takes the
+// oldest request and waits until "server.max-batch" requests are queued or
+// "server.batch-deadline-ms" has passed since it arrived, then labels them
+// all with a single inference run.
+class LabelServer {
+private:
+  struct Request {
+    std::string contents;
+    int64_t receivedUs;
+    bool done;
+    BatchImage image;
+  };
+
+  struct Connection {
+    LabelServer *server;
+    int fd;
+  };
+
+  Config *config;
+  StartupReport *startup;
+  DecodeBudget *decodeBudget;
+  LabelImage *labelImage;
+  int listenFd;
+  ThreadPool *mAcceptPool;
+  ThreadPool *mConnectionPool;
+  ThreadPool *mBatchPool;
+  std::atomic<int> mConnections;
+  // Connections that closed before their response could be written.
+  std::atomic<uint64_t> mDropped;
+  // Numbers requests, so every one gets its own image name.
+  std::atomic<uint64_t> mNextRequest;
+
+  std::mutex mLock;
+  std::condition_variable mQueued;
+  std::condition_variable mDone;
+  std::deque<Request *> mQueue;
+
+  uint64_t mRequests;
+  uint64_t mBatches;
+  uint64_t mRejected;
+  std::vector<int64_t> mLatenciesUs;
+  int64_t mLastReportUs;
+
+  static void *_acceptRoutine (void *arg, struct event_base *base);
+  void *acceptRoutine ();
+  static void *_connectionRoutine (void *arg, struct event_base *base);
+  void *connectionRoutine (int fd);
+  static void *_batchRoutine (void *arg, struct event_base *base);
+  void *batchRoutine ();
+
+  void label(Request *request);
+  std::string respond(const Request &request);
+  void report(const std::vector<Request *> &batch);
+public:
+  LabelServer(Config *config, StartupReport *startup);
+  ~LabelServer();
+  // Returns 0 once the socket is listening and the model is warm.
+  int init();
+  // Listens and serves with a model that is already loaded; init() calls it
+  // once the model is warm.
+  int start(LabelImage *labelImage);
+  // The port listened on, which the system picks when "server.port" is 0.
+  int port();
+  void run();
+};
+
+#endif /* SRC_LABEL_SERVER_H_ */
@@ -2,6 +2,8 @@
 #include "label-client.h"
 
 #include "config.h"
+#include "golden-corpus.h"
+#include "label-server.h"
 
 static Config *config = nullptr;
 
@@ -9,8 +11,14 @@ int main(int argc, char* argv[]) {
 
   google::InstallFailureSignalHandler();
 
+  StartupReport *startup = new StartupReport();
+
   config = new Config();
-  config->init();
+  startup->time("config", [] { config->init(); });
+  if (!config->isValid()) {
+    LOG(ERROR) << "Invalid configuration";
+    return -1;
+  }
 
   PAL_LOGGER_INIT_PARAMS_X x_init_params = {false};
   pal_env_init ();                                                                 
@@ -38,6 +46,10 @@ int main(int argc, char* argv[]) {
   bool self_test = false;
   string root_dir = "";
   bool daemon = false;
+  string golden = "";
+  bool golden_record = false;
+  bool golden_baseline = false;
+  bool server = false;
   std::vector<Flag> flag_list = {
       Flag("daemon", &daemon, "Daemonize the process"),
       Flag("image", &image, "image to be processed"),
@@ -53,6 +65,14 @@ int main(int argc, char* argv[]) {
       Flag("self_test", &self_test, "run a self test"),
       Flag("root_dir", &root_dir,
            "interpret image and graph file names relative to this directory"),
+      Flag("golden", &golden,
+           "check labels and throughput against this golden corpus file, then exit"),
+      Flag("golden_record", &golden_record,
+           "record new golden labels and baseline instead of checking them"),
+      Flag("golden_baseline", &golden_baseline,
+           "record this machine's baseline, still checking the golden labels"),
+      Flag("server", &server,
+           "label images sent over the local socket instead of walking the tree"),
   };
   string usage = tensorflow::Flags::Usage(argv[0], flag_list);
   const bool parse_result = tensorflow::Flags::Parse(&argc, argv, flag_list);
@@ -73,8 +93,29 @@ int main(int argc, char* argv[]) {
     return -1;
   }
 
-  LabelClient *client = new LabelClient(config);
-  client->init();
+  Trace::init(config);
+  if (self_test) {
+    config->setSelfTest(true);
+  }
+
+  if (!golden.empty()) {
+    GoldenCorpus corpus(config, golden, golden_record, golden_baseline);
+    return corpus.run();
+  }
+
+  if (server) {
+    LabelServer *labelServer = new LabelServer(config, startup);
+    if (labelServer->init() != 0) {
+      return -1;
+    }
+    labelServer->run();
+    return 0;
+  }
+
+  LabelClient *client = new LabelClient(config, startup);
+  if (client->init() != 0) {
+    return -1;
+  }
   client->process();
 
   return 0;
@@ -0,0 +1,155 @@
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <condition_variable>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "prefetcher.h"
+
+namespace {
+
+// Collects what the prefetcher hands on. Admission reserves a fixed amount
+// per file and rejects paths containing "bad". While held, the consumer
+// blocks in the callback so that files pile up behind it.
+struct Sink {
+  std::mutex lock;
+  std::condition_variable released;
+  bool held = false;
+  uint64_t reserve = 0;
+  std::vector<PrefetchedFile> files;
+
+  size_t count() {
+    std::lock_guard<std::mutex> guard(lock);
+    return files.size();
+  }
+  void release() {
+    std::lock_guard<std::mutex> guard(lock);
+    held = false;
+    released.notify_all();
+  }
+};
+
+bool Admit(const std::string &path, uint64_t *reserved, void *this_) {
+  Sink *sink = (Sink *) this_;
+  *reserved = sink->reserve;
+  return path.find("bad") == std::string::npos;
+}
+
+void Collect(const std::vector<PrefetchedFile *> &files, void *this_) {
+  Sink *sink = (Sink *) this_;
+  std::unique_lock<std::mutex> lock(sink->lock);
+  for (PrefetchedFile *file : files) {
+    sink->files.push_back(*file);
+  }
+  sink->released.wait(lock, [sink] { return !sink->held; });
+}
+
+std::string WriteFile(const std::string &name, const std::string &contents) {
+  std::string path = tensorflow::testing::TmpDir() + "/" + name;
+  std::ofstream(path, std::ios::binary) << contents;
+  return path;
+}
+
+// Prefetchers and sinks are never deleted; their threads run for the life of
+// the process, like in the client.
+Prefetcher *StartPrefetcher(const std::string &name, DecodeBudget *budget,
+                            Sink *sink) {
+  Config *config = LoadTestConfig(name, {
+    {"prefetch", {
+      {"enabled", true},
+      {"depth", 8},
+      {"readers", 4},
+      {"max-bytes-mb", 1},
+      {"batch-size", 1},
+      {"batch-deadline-ms", 0}
+    }}
+  });
+  Prefetcher *prefetcher = new Prefetcher(config, budget);
+  prefetcher->init(Admit, Collect, sink, 0);
+  return prefetcher;
+}
+
+TEST(PrefetcherTest, RejectsAndSkipsBeforeReading) {
+  Sink *sink = new Sink();
+  Prefetcher *prefetcher = StartPrefetcher("prefetcher-admit", NULL, sink);
+  std::string small = WriteFile("small.jpg", "small");
+  std::string bad = WriteFile("bad.jpg", "rejected");
+  // Over prefetch.max-bytes-mb, so the labeler has to read it itself.
+  std::string large = WriteFile("large.jpg", std::string(2 * 1024 * 1024, 'l'));
+  prefetcher->submit(small);
+  prefetcher->submit(bad);
+  prefetcher->submit(large);
+  ASSERT_TRUE(WaitFor([sink] { return sink->count() == 3; }, 5000));
+
+  // Still in discovery order.
+  EXPECT_EQ(small, sink->files[0].path);
+  EXPECT_TRUE(sink->files[0].ok);
+  EXPECT_EQ("small", sink->files[0].contents);
+  EXPECT_EQ(bad, sink->files[1].path);
+  EXPECT_TRUE(sink->files[1].rejected);
+  EXPECT_TRUE(sink->files[1].contents.empty());
+  EXPECT_EQ(large, sink->files[2].path);
+  EXPECT_FALSE(sink->files[2].rejected);
+  EXPECT_FALSE(sink->files[2].ok);
+  EXPECT_TRUE(sink->files[2].contents.empty());
+  EXPECT_EQ(0u, sink->files[2].size);
+}
+
+TEST(PrefetcherTest, QueuedFilesHoldTheDecodeBudget) {
+  DecodeBudget *budget = new DecodeBudget(1000);
+  Sink *sink = new Sink();
+  sink->reserve = 400;
+  sink->held = true;
+  Prefetcher *prefetcher = StartPrefetcher("prefetcher-budget", budget, sink);
+  std::vector<std::string> paths;
+  for (int file = 0; file < 6; ++file) {
+    paths.push_back(WriteFile("budget-" + std::to_string(file) + ".jpg",
+                              "file " + std::to_string(file)));
+  }
+
+  // The first file is held by the labeler. Only one more fits beside it, and
+  // the rest wait for room rather than reading.
+  prefetcher->submit(paths[0]);
+  ASSERT_TRUE(WaitFor([sink] { return sink->count() == 1; }, 5000));
+  for (size_t pos = 1; pos < paths.size(); ++pos) {
+    prefetcher->submit(paths[pos]);
+  }
+  ASSERT_TRUE(WaitFor([budget] { return budget->inUse() == 800; }, 5000));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_EQ(800u, budget->inUse());
+
+  sink->release();
+  ASSERT_TRUE(WaitFor([sink] { return sink->count() == 6; }, 5000));
+  EXPECT_TRUE(WaitFor([budget] { return budget->inUse() == 0; }, 5000));
+  // A file that becomes the oldest while waiting goes ahead of the budget,
+  // so the most it can be over is one file.
+  EXPECT_LE(budget->peak(), 1400u);
+  for (size_t pos = 0; pos < paths.size(); ++pos) {
+    EXPECT_EQ(paths[pos], sink->files[pos].path);
+    EXPECT_EQ(400u, sink->files[pos].reserved);
+    EXPECT_EQ("file " + std::to_string(pos), sink->files[pos].contents);
+  }
+}
+
+TEST(PrefetcherTest, OldestFileGoesAheadOverBudget) {
+  DecodeBudget *budget = new DecodeBudget(1000);
+  Sink *sink = new Sink();
+  // Each file alone is over the budget.
+  sink->reserve = 1500;
+  Prefetcher *prefetcher = StartPrefetcher("prefetcher-head", budget, sink);
+  for (int file = 0; file < 3; ++file) {
+    prefetcher->submit(WriteFile("head-" + std::to_string(file) + ".jpg",
+                                 "file"));
+  }
+  // None of them would ever fit, yet none are stuck.
+  ASSERT_TRUE(WaitFor([sink] { return sink->count() == 3; }, 5000));
+  EXPECT_TRUE(WaitFor([budget] { return budget->inUse() == 0; }, 5000));
+  // The oldest beside at most one that got in while the budget was empty.
+  EXPECT_LE(budget->peak(), 3000u);
+}
+
+}  // namespace
@@ -0,0 +1,294 @@
+#include <chrono>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glog/logging.h>
+
+#include "prefetcher.h"
+#include "trace.h"
+
+using ChCppUtils::ThreadJob;
+
+Prefetcher::Prefetcher(Config *config, DecodeBudget *budget) {
+  this->config = config;
+  this->budget = budget;
+  onAdmit = NULL;
+  onPrefetched = NULL;
+  onPrefetchedThis = NULL;
+  mReaderPool = NULL;
+  mConsumerPool = NULL;
+  mBytesInFlight = 0;
+  mReaderThreads = 0;
+  mActiveReaders = 0;
+  mBatchSize = std::max(1, config->getPrefetchBatchSize());
+  mBatchDeadlineUs = config->getPrefetchBatchDeadlineMs() * 1000LL;
+  mReady = 0;
+  mRejected = 0;
+  mTooLarge = 0;
+  mStalls = 0;
+  mStallUs = 0;
+  mLastReportUs = 0;
+}
+
+Prefetcher::~Prefetcher() {
+}
+
+void Prefetcher::init(OnAdmit onAdmit, OnPrefetched onPrefetched, void *this_,
+                      int maxReaders) {
+  this->onAdmit = onAdmit;
+  this->onPrefetched = onPrefetched;
+  this->onPrefetchedThis = this_;
+  mLastReportUs = Trace::now();
+
+  mActiveReaders = std::max(1, config->getPrefetchReaders());
+  mReaderThreads = std::max(mActiveReaders, maxReaders);
+  mReaderPool = new ThreadPool (mReaderThreads, false);
+  for (int id = 0; id < mReaderThreads; ++id) {
+    Reader *reader = new Reader();
+    reader->prefetcher = this;
+    reader->id = id;
+    mReaderPool->addJob(new ThreadJob (Prefetcher::_readerRoutine, reader));
+  }
+  mConsumerPool = new ThreadPool (1, false);
+  mConsumerPool->addJob(new ThreadJob (Prefetcher::_consumerRoutine, this));
+  LOG(INFO) << "Prefetching " << config->getPrefetchDepth() << " files ahead with " <<
+    mActiveReaders << " readers, at most " << config->getPrefetchMaxBytes() / (1024 * 1024) <<
+    " MB in flight, batches of " << mBatchSize;
+}
+
+void Prefetcher::setReaders(int readers) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mActiveReaders = std::min(std::max(1, readers), mReaderThreads);
+  mChanged.notify_all();
+}
+
+void Prefetcher::setBatch(int size, int deadlineMs) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mBatchSize = std::max(1, size);
+  mBatchDeadlineUs = std::max(0, deadlineMs) * 1000LL;
+  mChanged.notify_all();
+}
+
+int Prefetcher::getReaders() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mActiveReaders;
+}
+
+int Prefetcher::getBatchSize() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mBatchSize;
+}
+
+int Prefetcher::getBatchDeadlineMs() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mBatchDeadlineUs / 1000;
+}
+
+void Prefetcher::submit(const std::string &path) {
+  PrefetchedFile *file = new PrefetchedFile();
+  file->path = path;
+  file->size = 0;
+  file->reserved = 0;
+  file->done = false;
+  file->ok = false;
+  file->rejected = false;
+  file->queuedUs = Trace::now();
+
+  size_t depth = std::max(1, config->getPrefetchDepth());
+  std::unique_lock<std::mutex> lock(mLock);
+  mChanged.wait(lock, [this, depth] { return mQueue.size() < depth; });
+  mQueue.push_back(file);
+  mUnread.push_back(file);
+  mChanged.notify_all();
+}
+
+void * Prefetcher::_readerRoutine (void *arg, struct event_base *base) {
+  Reader *reader = (Reader *) arg;
+  Prefetcher *prefetcher = reader->prefetcher;
+  int id = reader->id;
+  delete reader;
+  return prefetcher->readerRoutine(id);
+}
+
+// Readers numbered at or above the active count sit idle until it's raised.
+void *Prefetcher::readerRoutine (int id) {
+  while (true) {
+    PrefetchedFile *file = NULL;
+    {
+      std::unique_lock<std::mutex> lock(mLock);
+      mChanged.wait(lock, [this, id] {
+        return id < mActiveReaders && !mUnread.empty();
+      });
+      file = mUnread.front();
+      mUnread.pop_front();
+    }
+    read(file);
+  }
+  return NULL;
+}
+
+void Prefetcher::read(PrefetchedFile *file) {
+  TraceSpan span("read-ahead", file->path);
+  int fd = open(file->path.c_str(), O_RDONLY);
+  struct stat st;
+  uint64_t size = 0;
+  if (fd >= 0 && fstat(fd, &st) == 0) {
+    size = st.st_size;
+  }
+
+  // Only the header is read to admit it. A rejected file is handed on unread
+  // so that it still leaves the queue in order.
+  if (fd >= 0 && onAdmit != NULL &&
+      !onAdmit(file->path, &file->reserved, onPrefetchedThis)) {
+    close(fd);
+    std::lock_guard<std::mutex> lock(mLock);
+    file->reserved = 0;
+    file->rejected = true;
+    file->done = true;
+    mRejected++;
+    mChanged.notify_all();
+    return;
+  }
+
+  uint64_t max_bytes = config->getPrefetchMaxBytes();
+  bool read_ahead = fd >= 0 && size <= max_bytes;
+  if (read_ahead) {
+    // Start the kernel's readahead for the whole file while we wait for room.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+  uint64_t bytes = read_ahead ? size : 0;
+  {
+    std::unique_lock<std::mutex> lock(mLock);
+    if (fd >= 0 && !read_ahead) {
+      mTooLarge++;
+    }
+    while (true) {
+      if (file == mQueue.front()) {
+        // Everything behind it is waiting on it.
+        if (budget != NULL) {
+          budget->take(file->reserved);
+        }
+        break;
+      }
+      if (mBytesInFlight + bytes <= max_bytes &&
+          (budget == NULL || budget->tryAcquire(file->reserved))) {
+        break;
+      }
+      // Labeling outside the prefetcher releases budget without waking us,
+      // so look again every so often.
+      mChanged.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    mBytesInFlight += bytes;
+    file->size = bytes;
+  }
+
+  bool ok = read_ahead;
+  if (read_ahead) {
+    file->contents.resize(size);
+    size_t offset = 0;
+    while (offset < size) {
+      ssize_t done = pread(fd, &file->contents[offset], size - offset, offset);
+      if (done <= 0) {
+        ok = false;
+        break;
+      }
+      offset += done;
+    }
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  span.end();
+
+  std::lock_guard<std::mutex> lock(mLock);
+  file->ok = ok;
+  file->done = true;
+  mChanged.notify_all();
+}
+
+// Called with mLock held. How many files at the front of the queue are read,
+// up to a batch.
+size_t Prefetcher::ready() {
+  size_t count = 0;
+  while (count < mQueue.size() && count < mBatchSize && mQueue[count]->done) {
+    count++;
+  }
+  return count;
+}
+
+void * Prefetcher::_consumerRoutine (void *arg, struct event_base *base) {
+  Prefetcher *prefetcher = (Prefetcher *) arg;
+  return prefetcher->consumerRoutine();
+}
+
+void *Prefetcher::consumerRoutine () {
+  std::vector<PrefetchedFile *> batch;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mLock);
+      mChanged.wait(lock, [this] { return !mQueue.empty(); });
+      PrefetchedFile *head = mQueue.front();
+      if (head->done) {
+        mReady++;
+      } else {
+        // The labeler caught up with the readers: storage is the bottleneck.
+        int64_t waiting = Trace::now();
+        mChanged.wait(lock, [head] { return head->done; });
+        mStalls++;
+        mStallUs += Trace::now() - waiting;
+        Trace::record("prefetch-stall", head->path, waiting, Trace::now());
+      }
+
+      // Give the files behind it until the deadline to fill the batch.
+      int64_t deadline = Trace::now() + mBatchDeadlineUs;
+      while (ready() < mBatchSize && Trace::now() < deadline) {
+        mChanged.wait_for(lock,
+          std::chrono::microseconds(deadline - Trace::now()));
+      }
+      batch.assign(mQueue.begin(), mQueue.begin() + ready());
+      report();
+    }
+
+    int64_t now = Trace::now();
+    for (PrefetchedFile *file : batch) {
+      Trace::record("prefetch-queue", file->path, file->queuedUs, now);
+    }
+    onPrefetched(batch, onPrefetchedThis);
+
+    {
+      std::lock_guard<std::mutex> lock(mLock);
+      for (PrefetchedFile *file : batch) {
+        mQueue.pop_front();
+        mBytesInFlight -= file->size;
+        if (budget != NULL) {
+          budget->release(file->reserved);
+        }
+        delete file;
+      }
+      mChanged.notify_all();
+    }
+  }
+  return NULL;
+}
+
+// Called with mLock held.
+void Prefetcher::report() {
+  int64_t now = Trace::now();
+  if (now - mLastReportUs < 10000000LL) {
+    return;
+  }
+  LOG(INFO) << "Prefetch: " << mReady << " ready, " << mStalls <<
+    " stalls (" << mStallUs / 1000 << " ms), " << mRejected <<
+    " rejected, " << mTooLarge << " too large to read ahead, " <<
+    mQueue.size() <<
+    " queued, " << mBytesInFlight / (1024 * 1024) << " MB in flight, " <<
+    mActiveReaders << " readers, batches of " << mBatchSize;
+  mReady = 0;
+  mRejected = 0;
+  mTooLarge = 0;
+  mStalls = 0;
+  mStallUs = 0;
+  mLastReportUs = now;
+}
@@ -0,0 +1,116 @@
+#ifndef SRC_PREFETCHER_H_
+#define SRC_PREFETCHER_H_
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <condition_variable>
+#include <event2/event.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+
+#include "config.h"
+#include "decode-budget.h"
+
+using ChCppUtils::ThreadPool;
+
+// A file queued for the labeler. A rejected file failed admission and was
+// never read. Otherwise ok is true if its contents were read ahead; if not,
+// because it was over "prefetch.max-bytes-mb" or the read failed, the labeler
+// reads it itself. reserved is the decode budget held for it until
+// OnPrefetched returns, and size the bytes of it held in memory.
+struct PrefetchedFile {
+  std::string path;
+  std::string contents;
+  uint64_t size;
+  uint64_t reserved;
+  bool done;
+  bool ok;
+  bool rejected;
+  int64_t queuedUs;
+};
+
+// Called by a reader before a file is read, to check its header against the
+// decode limits. Returns false to reject it, or true with the decode budget
+// to reserve for it.
+typedef bool (*OnAdmit) (const std::string &path, uint64_t *reserved,
+      void *this_);
+
+// Called in discovery order with the next batch of files.
+typedef void (*OnPrefetched) (const std::vector<PrefetchedFile *> &files,
+      void *this_);
+
+// Reads files ahead of the labeler so that slow storage overlaps with
+// inference instead of stalling it. Paths are queued as they are discovered,
+// up to "prefetch.depth" ahead of the one being labeled. "prefetch.readers"
+// threads admit each file by its header, hint the kernel with posix_fadvise
+// and read it into memory while the bytes held stay under
+// "prefetch.max-bytes-mb". A single consumer thread hands them on in
+// discovery order, in batches of up to "prefetch.batch-size" files, waiting
+// at most "prefetch.batch-deadline-ms" for a batch to fill. Reader count and
+// batching can be changed while running.
+//
+// Files are admitted before anything past the header is read, and files over
+// "prefetch.max-bytes-mb" are never read ahead. Every queued file holds its
+// decode reservation in the shared DecodeBudget, taken only if it fits; the
+// oldest queued file always goes ahead, so the queue can't wedge, and the
+// bytes held stay under twice the limit.
+class Prefetcher {
+private:
+  struct Reader {
+    Prefetcher *prefetcher;
+    int id;
+  };
+
+  Config *config;
+  DecodeBudget *budget;
+  OnAdmit onAdmit;
+  OnPrefetched onPrefetched;
+  void *onPrefetchedThis;
+  ThreadPool *mReaderPool;
+  ThreadPool *mConsumerPool;
+
+  std::mutex mLock;
+  std::condition_variable mChanged;
+  std::deque<PrefetchedFile *> mQueue;
+  std::deque<PrefetchedFile *> mUnread;
+  uint64_t mBytesInFlight;
+  int mReaderThreads;
+  int mActiveReaders;
+  size_t mBatchSize;
+  int64_t mBatchDeadlineUs;
+
+  uint64_t mReady;
+  uint64_t mRejected;
+  uint64_t mTooLarge;
+  uint64_t mStalls;
+  int64_t mStallUs;
+  int64_t mLastReportUs;
+
+  static void *_readerRoutine (void *arg, struct event_base *base);
+  void *readerRoutine (int id);
+  static void *_consumerRoutine (void *arg, struct event_base *base);
+  void *consumerRoutine ();
+
+  void read(PrefetchedFile *file);
+  size_t ready();
+  void report();
+public:
+  // budget may be NULL, in which case nothing is reserved.
+  Prefetcher(Config *config, DecodeBudget *budget);
+  ~Prefetcher();
+  // Starts maxReaders reader threads, of which "prefetch.readers" read.
+  // onAdmit may be NULL to admit every file.
+  void init(OnAdmit onAdmit, OnPrefetched onPrefetched, void *this_,
+        int maxReaders);
+  void setReaders(int readers);
+  void setBatch(int size, int deadlineMs);
+  int getReaders();
+  int getBatchSize();
+  int getBatchDeadlineMs();
+  // Blocks while "prefetch.depth" files are already queued.
+  void submit(const std::string &path);
+};
+
+#endif /* SRC_PREFETCHER_H_ */
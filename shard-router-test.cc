@@ -0,0 +1,141 @@
+#include <set>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sys/stat.h>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "shard-router.h"
+
+namespace {
+
+std::string LeaseDir(const std::string &name) {
+  std::string dir = tensorflow::testing::TmpDir() + "/" + name;
+  mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+struct Takeovers {
+  std::mutex lock;
+  std::vector<ShardTakeover> seen;
+
+  static void onClaim(const ShardTakeover &takeover, void *this_) {
+    Takeovers *takeovers = (Takeovers *) this_;
+    std::lock_guard<std::mutex> lock(takeovers->lock);
+    takeovers->seen.push_back(takeover);
+  }
+  size_t count() {
+    std::lock_guard<std::mutex> lock(this->lock);
+    return seen.size();
+  }
+};
+
+std::vector<std::string> Paths() {
+  std::vector<std::string> paths;
+  for (int i = 0; i < 200; ++i) {
+    paths.push_back("./images/" + std::to_string(i) + ".jpg");
+  }
+  return paths;
+}
+
+// A peer that wrote its lease once and half of its paths to its done file,
+// then died. Only the other half comes back to us.
+TEST(ShardRouterTest, TakesOverUnfinishedPathsOfADeadPeer) {
+  std::string dir = LeaseDir("shard-router-takeover");
+  std::ofstream(dir + "/peer.lease") << "1\n";
+  std::ofstream(dir + "/peer.done", std::ios::trunc);
+
+  Config *config = LoadTestConfig("shard-router-takeover", {
+    {"shard", {
+      {"id", "self"},
+      {"lease-dir", dir},
+      {"lease-ttl-ms", 300},
+      {"heartbeat-ms", 50}
+    }}
+  });
+  // Leaked; the heartbeat runs for the life of the process.
+  ShardRouter *router = new ShardRouter(config);
+  Takeovers *takeovers = new Takeovers();
+
+  router->init(Takeovers::onClaim, takeovers);
+  std::set<std::string> peers, finished;
+  {
+    std::ofstream done(dir + "/peer.done", std::ios::app);
+    for (auto &path : Paths()) {
+      if (router->claim(path)) {
+        router->done(path);
+      } else if (peers.insert(path).second && peers.size() % 2 == 0) {
+        done << path << '\n';
+        finished.insert(path);
+      }
+    }
+  }
+  ASSERT_GT(peers.size(), 50u);
+  ASSERT_LT(peers.size(), 150u);
+
+  ASSERT_TRUE(WaitFor([takeovers] { return takeovers->count() > 0; }, 5000));
+  ShardTakeover takeover = takeovers->seen[0];
+  EXPECT_EQ(std::set<std::string>({"peer"}), takeover.lost);
+  EXPECT_EQ(finished, takeover.done);
+
+  std::set<std::string> reclaimed;
+  for (auto &path : Paths()) {
+    EXPECT_TRUE(router->claim(path));
+    if (router->reclaim(takeover, path)) {
+      reclaimed.insert(path);
+    }
+  }
+  std::set<std::string> unfinished;
+  for (auto &path : peers) {
+    if (finished.count(path) == 0) {
+      unfinished.insert(path);
+    }
+  }
+  EXPECT_EQ(unfinished, reclaimed);
+
+  // What we finished ourselves is on disk for whoever takes over from us.
+  size_t ours = Paths().size() - peers.size();
+  EXPECT_TRUE(WaitFor([dir, ours] {
+    std::ifstream done(dir + "/self.done");
+    std::string line;
+    size_t lines = 0;
+    while (std::getline(done, line)) {
+      lines++;
+    }
+    return lines == ours;
+  }, 2000));
+}
+
+TEST(ShardRouterTest, StaticShardsSplitEveryPathOnce) {
+  std::vector<ShardRouter *> routers;
+  for (int index = 0; index < 3; ++index) {
+    Config *config = LoadTestConfig("shard-router-static-" +
+        std::to_string(index), {{"shard", {{"index", index}, {"count", 3}}}});
+    ASSERT_TRUE(config->isValid());
+    routers.push_back(new ShardRouter(config));
+    routers.back()->init(NULL, NULL);
+  }
+  for (auto &path : Paths()) {
+    int owners = 0;
+    for (auto router : routers) {
+      owners += router->claim(path) ? 1 : 0;
+    }
+    EXPECT_EQ(1, owners) << path;
+  }
+}
+
+TEST(ShardRouterTest, RejectsIndexOutsideCount) {
+  EXPECT_FALSE(LoadTestConfig("shard-router-index",
+      {{"shard", {{"index", 2}, {"count", 2}}}})->isValid());
+  EXPECT_FALSE(LoadTestConfig("shard-router-count",
+      {{"shard", {{"index", 0}, {"count", 0}}}})->isValid());
+  EXPECT_FALSE(LoadTestConfig("shard-router-negative",
+      {{"shard", {{"index", -1}, {"count", 2}}}})->isValid());
+  EXPECT_TRUE(LoadTestConfig("shard-router-valid",
+      {{"shard", {{"index", 1}, {"count", 2}}}})->isValid());
+}
+
+}  // namespace
@@ -0,0 +1,268 @@
+#include <set>
+#include <thread>
+#include <fstream>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glog/logging.h>
+
+#include "shard-router.h"
+
+using ChCppUtils::ThreadJob;
+
+static const std::string kLeaseSuffix = ".lease";
+static const std::string kDoneSuffix = ".done";
+
+// FNV-1a over member and path, finished with the splitmix64 mixer so that
+// similar paths spread evenly.
+static uint64_t Score(const std::string &member, const std::string &path) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : member) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  hash = (hash ^ 0xFF) * 1099511628211ULL;
+  for (unsigned char c : path) {
+    hash = (hash ^ c) * 1099511628211ULL;
+  }
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+ShardRouter::ShardRouter(Config *config) {
+  this->config = config;
+  onClaim = NULL;
+  onClaimThis = NULL;
+  mHeartbeatPool = NULL;
+  heartbeat = 0;
+}
+
+ShardRouter::~ShardRouter() {
+}
+
+bool ShardRouter::leased() {
+  return !config->getShardLeaseDir().empty();
+}
+
+std::string ShardRouter::leaseDir() {
+  return config->getShardLeaseDir();
+}
+
+void ShardRouter::init(OnClaim onClaim, void *this_) {
+  this->onClaim = onClaim;
+  this->onClaimThis = this_;
+
+  if (leased()) {
+    self = config->getShardId();
+    if (self.empty()) {
+      char hostname[256] = {0};
+      gethostname(hostname, sizeof(hostname) - 1);
+      self = std::string(hostname) + "-" + std::to_string(getpid());
+    }
+    mkdir(leaseDir().c_str(), 0755);
+    // Whatever an earlier run under the same id finished gets walked again
+    // by this one anyway.
+    std::ofstream(leaseDir() + "/" + self + kDoneSuffix, std::ios::trunc);
+    writeLease();
+    // Give instances started alongside us a heartbeat to show up, so the
+    // first walk doesn't begin with everyone owning everything.
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(config->getShardHeartbeatMs()));
+    scanLeases();
+
+    mHeartbeatPool = new ThreadPool (1, false);
+    ThreadJob *job = new ThreadJob (ShardRouter::_heartbeatRoutine, this);
+    mHeartbeatPool->addJob(job);
+  } else if (config->getShardCount() > 1) {
+    for (int index = 0; index < config->getShardCount(); ++index) {
+      members.push_back(std::to_string(index));
+    }
+    self = std::to_string(config->getShardIndex());
+  } else {
+    self = "0";
+    members.push_back(self);
+  }
+  LOG(INFO) << "Shard " << self << " of " << members.size() << " members";
+}
+
+const std::string &ShardRouter::owner(const std::vector<std::string> &members,
+                                     const std::string &path) {
+  size_t best = 0;
+  uint64_t bestScore = 0;
+  for (size_t pos = 0; pos < members.size(); ++pos) {
+    uint64_t score = Score(members[pos], path);
+    if (pos == 0 || score > bestScore) {
+      best = pos;
+      bestScore = score;
+    }
+  }
+  return members[best];
+}
+
+bool ShardRouter::claim(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mLock);
+  if (members.size() <= 1) {
+    return true;
+  }
+  return owner(members, path) == self;
+}
+
+void ShardRouter::done(const std::string &path) {
+  if (!leased()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mDoneLock);
+  mDone.push_back(path);
+}
+
+bool ShardRouter::reclaim(const ShardTakeover &takeover,
+                          const std::string &path) {
+  if (takeover.members.empty() ||
+      takeover.lost.count(owner(takeover.members, path)) == 0 ||
+      takeover.done.count(path) != 0) {
+    return false;
+  }
+  return claim(path);
+}
+
+void ShardRouter::writeLease() {
+  std::string path = leaseDir() + "/" + self + kLeaseSuffix;
+  std::string temp = path + ".tmp";
+  {
+    std::ofstream lease(temp, std::ios::trunc);
+    lease << ++heartbeat << '\n';
+  }
+  // Rename so peers never read a half written lease.
+  if (rename(temp.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Unable to write lease " << path;
+  }
+}
+
+// One path per line, appended; paths with newlines in them are not supported.
+void ShardRouter::flushDone() {
+  std::vector<std::string> finished;
+  {
+    std::lock_guard<std::mutex> lock(mDoneLock);
+    finished.swap(mDone);
+  }
+  if (finished.empty()) {
+    return;
+  }
+  std::ofstream file(leaseDir() + "/" + self + kDoneSuffix, std::ios::app);
+  for (auto &path : finished) {
+    file << path << '\n';
+  }
+  if (!file) {
+    LOG(ERROR) << "Unable to record finished paths for " << self;
+  }
+}
+
+void ShardRouter::readDone(const std::string &member,
+                           std::set<std::string> *done) {
+  std::ifstream file(leaseDir() + "/" + member + kDoneSuffix);
+  std::string path;
+  while (std::getline(file, path)) {
+    done->insert(path);
+  }
+}
+
+void ShardRouter::scanLeases() {
+  std::string dir = leaseDir();
+  Clock::time_point now = Clock::now();
+  std::chrono::milliseconds ttl(config->getShardLeaseTtlMs());
+  ShardTakeover takeover;
+
+  DIR *handle = opendir(dir.c_str());
+  if (handle == NULL) {
+    LOG(ERROR) << "Unable to read lease directory " << dir;
+    return;
+  }
+  std::map<std::string, std::string> leases;
+  struct dirent *entry = NULL;
+  while ((entry = readdir(handle)) != NULL) {
+    std::string name = entry->d_name;
+    if (name.length() <= kLeaseSuffix.length() ||
+        name.compare(name.length() - kLeaseSuffix.length(),
+                     kLeaseSuffix.length(), kLeaseSuffix) != 0) {
+      continue;
+    }
+    std::ifstream lease(dir + "/" + name);
+    std::string content;
+    std::getline(lease, content);
+    leases[name.substr(0, name.length() - kLeaseSuffix.length())] = content;
+  }
+  closedir(handle);
+
+  {
+    std::lock_guard<std::mutex> lock(mLock);
+    // A lease counts as alive while its content keeps changing. Only our own
+    // clock is involved, so skew between hosts doesn't matter.
+    for (auto &lease : leases) {
+      auto peer = peers.find(lease.first);
+      if (peer == peers.end() || peer->second.lease != lease.second) {
+        Peer updated = {lease.second, now};
+        peers[lease.first] = updated;
+      }
+    }
+
+    std::set<std::string> live;
+    live.insert(self);
+    for (auto peer = peers.begin(); peer != peers.end();) {
+      if (now - peer->second.changed < ttl) {
+        live.insert(peer->first);
+      } else if (now - peer->second.changed > ttl * 10) {
+        // Long dead, and long since taken over; clean up after it.
+        unlink((dir + "/" + peer->first + kLeaseSuffix).c_str());
+        unlink((dir + "/" + peer->first + kDoneSuffix).c_str());
+        peer = peers.erase(peer);
+        continue;
+      }
+      ++peer;
+    }
+
+    std::vector<std::string> current(live.begin(), live.end());
+    if (current == members) {
+      return;
+    }
+    for (auto &member : members) {
+      if (live.find(member) == live.end()) {
+        takeover.lost.insert(member);
+      }
+    }
+    takeover.members = members;
+    members = current;
+    LOG(INFO) << "Shard " << self << " now one of " << members.size() <<
+      " members, " << takeover.lost.size() << " lost";
+  }
+
+  if (takeover.lost.empty()) {
+    return;
+  }
+  for (auto &member : takeover.lost) {
+    readDone(member, &takeover.done);
+  }
+  LOG(INFO) << "Taking over from " << takeover.lost.size() << " peers, " <<
+    takeover.done.size() << " of their paths already done";
+  if (onClaim != NULL) {
+    onClaim(takeover, onClaimThis);
+  }
+}
+
+void * ShardRouter::_heartbeatRoutine (void *arg, struct event_base *base) {
+  ShardRouter *router = (ShardRouter *) arg;
+  return router->heartbeatRoutine();
+}
+
+void *ShardRouter::heartbeatRoutine () {
+  std::chrono::milliseconds interval(config->getShardHeartbeatMs());
+  while (true) {
+    std::this_thread::sleep_for(interval);
+    flushDone();
+    writeLease();
+    scanLeases();
+  }
+  return NULL;
+}
@@ -0,0 +1,89 @@
+#ifndef SRC_SHARD_ROUTER_H_
+#define SRC_SHARD_ROUTER_H_
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <event2/event.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+
+#include "config.h"
+
+using ChCppUtils::ThreadPool;
+
+// Peers that just died: the members as they were before, which of them were
+// lost, and the paths the lost ones had recorded as finished.
+struct ShardTakeover {
+  std::vector<std::string> members;
+  std::set<std::string> lost;
+  std::set<std::string> done;
+};
+
+typedef void (*OnClaim) (const ShardTakeover &takeover, void *this_);
+
+// Splits one tree between several client instances without a coordinator.
+// Every path is owned by the member with the highest hash of (member, path),
+// so each instance can decide on its own which paths are its to label, and
+// losing a member only moves that member's paths.
+//
+// Members come either from "shard.index"/"shard.count", or from lease files
+// that every instance keeps rewriting in "shard.lease-dir" on the shared
+// filesystem. A peer whose lease stops changing for "shard.lease-ttl-ms",
+// as seen by our own clock, is considered dead. Next to its lease every
+// instance appends the paths it has finished to a done file, flushed on each
+// heartbeat. When a peer dies OnClaim gets a ShardTakeover; the caller walks
+// the tree again and labels the paths reclaim() hands to us, which are the
+// dead peer's paths it never finished. Nothing about other members' paths is
+// kept in memory. Labels are PUT by id, so redoing what a peer finished after
+// its last flush is harmless.
+class ShardRouter {
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Peer {
+    std::string lease;
+    Clock::time_point changed;
+  };
+
+  Config *config;
+  OnClaim onClaim;
+  void *onClaimThis;
+  ThreadPool *mHeartbeatPool;
+
+  std::mutex mLock;
+  std::string self;
+  std::vector<std::string> members;
+  std::map<std::string, Peer> peers;
+  uint64_t heartbeat;
+
+  std::mutex mDoneLock;
+  std::vector<std::string> mDone;
+
+  static void *_heartbeatRoutine (void *arg, struct event_base *base);
+  void *heartbeatRoutine ();
+
+  bool leased();
+  std::string leaseDir();
+  void writeLease();
+  void flushDone();
+  void readDone(const std::string &member, std::set<std::string> *done);
+  void scanLeases();
+  static const std::string &owner(const std::vector<std::string> &members,
+                                  const std::string &path);
+public:
+  ShardRouter(Config *config);
+  ~ShardRouter();
+  void init(OnClaim onClaim, void *this_);
+  // True if this instance should label path.
+  bool claim(const std::string &path);
+  // Records that path has been labeled, for whoever takes over from us.
+  void done(const std::string &path);
+  // True if path belonged to a lost peer, wasn't finished by it, and is ours
+  // now.
+  bool reclaim(const ShardTakeover &takeover, const std::string &path);
+};
+
+#endif /* SRC_SHARD_ROUTER_H_ */
@@ -0,0 +1,47 @@
+#include <glog/logging.h>
+
+#include "startup-report.h"
+
+StartupReport::StartupReport() {
+  mStart = Clock::now();
+  mFirstLabel = false;
+}
+
+StartupReport::~StartupReport() {
+}
+
+double StartupReport::sinceStart(Clock::time_point time) {
+  return std::chrono::duration<double, std::milli>(time - mStart).count();
+}
+
+void StartupReport::time(const std::string &name, std::function<void()> fn) {
+  Clock::time_point start = Clock::now();
+  fn();
+  Clock::time_point end = Clock::now();
+
+  std::lock_guard<std::mutex> lock(mLock);
+  Phase phase = {name, sinceStart(start), sinceStart(end) - sinceStart(start)};
+  mPhases.push_back(phase);
+}
+
+void StartupReport::log() {
+  std::lock_guard<std::mutex> lock(mLock);
+  double serial = 0;
+  LOG(INFO) << "<-----------------------Startup";
+  for (auto &phase : mPhases) {
+    LOG(INFO) << phase.name << " : started at " << phase.startMs <<
+      " ms, took " << phase.durationMs << " ms";
+    serial += phase.durationMs;
+  }
+  LOG(INFO) << "Ready in " << sinceStart(Clock::now()) << " ms (" << serial <<
+    " ms if run one after another)";
+  LOG(INFO) << "----------------------->Startup";
+}
+
+void StartupReport::firstLabel() {
+  if (mFirstLabel.exchange(true)) {
+    return;
+  }
+  LOG(INFO) << "First label " << sinceStart(Clock::now()) <<
+    " ms after start";
+}
@@ -0,0 +1,40 @@
+#ifndef SRC_STARTUP_REPORT_H_
+#define SRC_STARTUP_REPORT_H_
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <functional>
+
+// Times the phases of startup, some of which run concurrently, and logs when
+// each started and how long it took relative to process start. The time to
+// the first label is logged separately once it happens.
+class StartupReport {
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Phase {
+    std::string name;
+    double startMs;
+    double durationMs;
+  };
+
+  Clock::time_point mStart;
+  std::mutex mLock;
+  std::vector<Phase> mPhases;
+  std::atomic<bool> mFirstLabel;
+
+  double sinceStart(Clock::time_point time);
+public:
+  StartupReport();
+  ~StartupReport();
+
+  // Runs fn and records how long it took under name.
+  void time(const std::string &name, std::function<void()> fn);
+  void log();
+  void firstLabel();
+};
+
+#endif /* SRC_STARTUP_REPORT_H_ */
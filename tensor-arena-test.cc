@@ -0,0 +1,98 @@
+#include <vector>
+#include <stdint.h>
+
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/platform/test.h"
+
+#include "tensor-arena.h"
+
+using tensorflow::Tensor;
+using tensorflow::TensorShape;
+
+namespace {
+
+// One image worth of the tensors LabelImage makes per run.
+void RunOnce(TensorArena *arena, int batch) {
+  arena->contents().scalar<tensorflow::string>()() = "encoded image";
+  Tensor input = arena->input(batch, 299, 299, 3);
+  input.flat<float>().setZero();
+  Tensor scores(arena, tensorflow::DT_FLOAT, TensorShape({batch, 1001}));
+  Tensor indices(arena, tensorflow::DT_INT32, TensorShape({batch, 5}));
+  Tensor k(arena, tensorflow::DT_INT32, TensorShape());
+  scores.flat<float>().setZero();
+  indices.flat<tensorflow::int32>().setZero();
+  k.scalar<tensorflow::int32>()() = 5;
+}
+
+TEST(TensorArenaTest, ReachesSteadyState) {
+  TensorArena arena;
+  for (int i = 0; i < 3; ++i) {
+    RunOnce(&arena, 1);
+    RunOnce(&arena, 4);
+  }
+  tensorflow::uint64 allocations = arena.allocations();
+  tensorflow::uint64 reuses = arena.reuses();
+  for (int i = 0; i < 1000; ++i) {
+    RunOnce(&arena, 1);
+    RunOnce(&arena, 4);
+  }
+  EXPECT_EQ(allocations, arena.allocations());
+  EXPECT_GT(arena.reuses(), reuses);
+}
+
+TEST(TensorArenaTest, VaryingBatchSizesStayBounded) {
+  TensorArena arena;
+  RunOnce(&arena, 16);
+  Tensor largest = arena.input(16, 299, 299, 3);
+  const float *data = largest.flat<float>().data();
+  tensorflow::uint64 allocations = arena.allocations();
+  for (int i = 0; i < 10; ++i) {
+    for (int batch = 1; batch <= 16; ++batch) {
+      Tensor input = arena.input(batch, 299, 299, 3);
+      EXPECT_EQ(batch, input.dim_size(0));
+      EXPECT_EQ(data, input.flat<float>().data());
+    }
+  }
+  // No new input batches; scores and indices for each new row count are
+  // allocated once and kept on the free list, but no more than its cap.
+  for (int i = 0; i < 10; ++i) {
+    for (int batch = 1; batch <= 16; ++batch) {
+      RunOnce(&arena, batch);
+    }
+  }
+  EXPECT_LE(arena.allocations(), allocations + 2 * 16);
+  EXPECT_LE(arena.freeBytes(), TensorArena::kMaxFreeBytes);
+}
+
+TEST(TensorArenaTest, FreeListIsCapped) {
+  TensorArena arena;
+  const size_t kBuffer = 1024 * 1024;
+  std::vector<void *> buffers;
+  for (size_t size = kBuffer; size < 2 * TensorArena::kMaxFreeBytes;
+       size += kBuffer) {
+    buffers.push_back(arena.AllocateRaw(TensorArena::kAlignment, size));
+  }
+  for (void *ptr : buffers) {
+    arena.DeallocateRaw(ptr);
+  }
+  EXPECT_GT(arena.freeBytes(), 0u);
+  EXPECT_LE(arena.freeBytes(), TensorArena::kMaxFreeBytes);
+}
+
+TEST(TensorArenaTest, ReusedBuffersKeepTheirAlignment) {
+  TensorArena arena;
+  void *loose = arena.AllocateRaw(4, 1000);
+  arena.DeallocateRaw(loose);
+  void *strict = arena.AllocateRaw(TensorArena::kAlignment, 1000);
+  EXPECT_EQ(loose, strict);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(strict) % TensorArena::kAlignment);
+  arena.DeallocateRaw(strict);
+}
+
+TEST(TensorArenaDeathTest, RejectsAlignmentAboveTheArenas) {
+  TensorArena arena;
+  EXPECT_DEATH(arena.AllocateRaw(2 * TensorArena::kAlignment, 1000),
+               "aligned");
+}
+
+}  // namespace
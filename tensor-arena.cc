@@ -0,0 +1,110 @@
+#include "tensorflow/core/platform/mem.h"
+#include "tensorflow/core/platform/logging.h"
+
+#include "tensor-arena.h"
+
+using tensorflow::Tensor;
+using tensorflow::TensorShape;
+
+const size_t TensorArena::kAlignment;
+const size_t TensorArena::kMaxFreeBytes;
+
+static_assert(TensorArena::kAlignment >=
+              tensorflow::Allocator::kAllocatorAlignment,
+              "arena buffers must meet the default tensor alignment");
+
+TensorArena::TensorArena() {
+  mAllocations = 0;
+  mReuses = 0;
+  mFreeBytes = 0;
+  mContents = Tensor(this, tensorflow::DT_STRING, TensorShape());
+}
+
+TensorArena::~TensorArena() {
+  mInput = Tensor();
+  mContents = Tensor();
+  for (auto &entry : mFree) {
+    for (void *ptr : entry.second) {
+      tensorflow::port::AlignedFree(ptr);
+    }
+  }
+}
+
+tensorflow::string TensorArena::Name() {
+  return "tensor_arena";
+}
+
+void *TensorArena::AllocateRaw(size_t alignment, size_t num_bytes) {
+  CHECK_LE(alignment, kAlignment) << "Arena buffers are only " << kAlignment <<
+    " byte aligned";
+  std::lock_guard<std::mutex> lock(mLock);
+  auto it = mFree.find(num_bytes);
+  if (it != mFree.end() && !it->second.empty()) {
+    void *ptr = it->second.back();
+    it->second.pop_back();
+    if (it->second.empty()) {
+      mFree.erase(it);
+    }
+    mFreeBytes -= num_bytes;
+    mReuses++;
+    return ptr;
+  }
+  // The free list is keyed on size alone, so every buffer gets the same
+  // alignment.
+  void *ptr = tensorflow::port::AlignedMalloc(num_bytes, kAlignment);
+  if (ptr != nullptr) {
+    mSizes[ptr] = num_bytes;
+    mAllocations++;
+  }
+  return ptr;
+}
+
+void TensorArena::DeallocateRaw(void *ptr) {
+  std::lock_guard<std::mutex> lock(mLock);
+  auto it = mSizes.find(ptr);
+  if (it == mSizes.end()) {
+    return;
+  }
+  if (mFreeBytes + it->second > kMaxFreeBytes) {
+    mSizes.erase(it);
+    tensorflow::port::AlignedFree(ptr);
+    return;
+  }
+  mFreeBytes += it->second;
+  mFree[it->second].push_back(ptr);
+}
+
+Tensor &TensorArena::contents() {
+  return mContents;
+}
+
+Tensor TensorArena::input(int batch, int height, int width, int channels) {
+  if (!mInput.IsInitialized() || mInput.dim_size(0) < batch ||
+      mInput.dim_size(1) != height || mInput.dim_size(2) != width ||
+      mInput.dim_size(3) != channels) {
+    // Release the old batch first so it can go back on the free list.
+    mInput = Tensor();
+    mInput = Tensor(this, tensorflow::DT_FLOAT,
+        TensorShape({batch, height, width, channels}));
+  }
+  if (mInput.dim_size(0) == batch) {
+    return mInput;
+  }
+  // Slicing from the first row keeps the buffer's alignment.
+  return mInput.Slice(0, batch);
+}
+
+tensorflow::uint64 TensorArena::allocations() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mAllocations;
+}
+
+tensorflow::uint64 TensorArena::reuses() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mReuses;
+}
+
+size_t TensorArena::freeBytes() {
+  std::lock_guard<std::mutex> lock(mLock);
+  return mFreeBytes;
+}
@@ -0,0 +1,57 @@
+#ifndef SRC_TENSOR_ARENA_H_
+#define SRC_TENSOR_ARENA_H_
+
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+#include "tensorflow/core/framework/allocator.h"
+#include "tensorflow/core/framework/tensor.h"
+#include "tensorflow/core/platform/types.h"
+
+// Per worker pool of tensor buffers. Buffers released by a tensor are kept on
+// a free list keyed by size and handed back out to the next tensor of the
+// same size, so steady state processing does not go back to malloc. Every
+// buffer is allocated at kAlignment, so any free buffer of the right size
+// satisfies any request; asking for more than that is a bug. Free buffers
+// beyond kMaxFreeBytes are given back rather than kept, so sizes that stop
+// coming up don't pin memory. It also owns the tensors that are fed into
+// every run: the raw file contents and one input batch sized for the largest
+// batch seen, which smaller batches are slices of.
+//
+// Not shared between workers; only the allocator entry points are locked,
+// since TensorFlow may release buffers from its own threads.
+class TensorArena : public tensorflow::Allocator {
+public:
+  static const size_t kAlignment = 64;
+  static const size_t kMaxFreeBytes = 64 * 1024 * 1024;
+private:
+  std::mutex mLock;
+  std::unordered_map<size_t, std::vector<void *>> mFree;
+  std::unordered_map<void *, size_t> mSizes;
+  size_t mFreeBytes;
+  tensorflow::uint64 mAllocations;
+  tensorflow::uint64 mReuses;
+
+  tensorflow::Tensor mContents;
+  tensorflow::Tensor mInput;
+public:
+  TensorArena();
+  ~TensorArena();
+
+  tensorflow::string Name() override;
+  void *AllocateRaw(size_t alignment, size_t num_bytes) override;
+  void DeallocateRaw(void *ptr) override;
+
+  // Scalar string tensor the encoded image is read into.
+  tensorflow::Tensor &contents();
+  // Float input of shape [batch, height, width, channels]. Shares the buffer
+  // of the largest batch, so it is only good until the next call.
+  tensorflow::Tensor input(int batch, int height, int width, int channels);
+
+  tensorflow::uint64 allocations();
+  tensorflow::uint64 reuses();
+  size_t freeBytes();
+};
+
+#endif /* SRC_TENSOR_ARENA_H_ */
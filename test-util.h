@@ -0,0 +1,137 @@
+#ifndef SRC_TEST_UTIL_H_
+#define SRC_TEST_UTIL_H_
+
+#include <vector>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <ch-cpp-utils/third-party/json/json.hpp>
+#include "tensorflow/core/platform/test.h"
+
+#include "config.h"
+
+// Writes a config file under the test temp dir with the given sections on top
+// of the elastic-search section every config needs, and loads it.
+inline Config *LoadTestConfig(const std::string &name,
+                              const nlohmann::json &sections) {
+  nlohmann::json json = {
+    {"elastic-search", {
+      {"protocol", "http"},
+      {"hostname", "127.0.0.1"},
+      {"port", 9200},
+      {"prefix-path", "/test/photo"}
+    }}
+  };
+  for (auto it = sections.begin(); it != sections.end(); ++it) {
+    json[it.key()] = it.value();
+  }
+  std::string path = tensorflow::testing::TmpDir() + "/" + name + ".json";
+  std::ofstream(path) << json.dump();
+  Config *config = new Config(path);
+  config->init();
+  return config;
+}
+
+// Polls until done() is true or the timeout runs out.
+inline bool WaitFor(std::function<bool()> done, int timeoutMs) {
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(timeoutMs);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return true;
+}
+
+// A gif with the given number of frames, each with one full data sub-block.
+// Nothing in the tests decodes it, so the image data is filler.
+inline std::string TestGif(int width, int height, int frames) {
+  auto append16 = [](std::string *out, int value) {
+    out->push_back(value & 0xFF);
+    out->push_back((value >> 8) & 0xFF);
+  };
+  std::string gif = "GIF89a";
+  append16(&gif, width);
+  append16(&gif, height);
+  gif += std::string("\x00\x00\x00", 3);
+  for (int frame = 0; frame < frames; ++frame) {
+    gif.push_back(0x2C);
+    append16(&gif, 0);
+    append16(&gif, 0);
+    append16(&gif, width);
+    append16(&gif, height);
+    gif.push_back(0x00);
+    gif.push_back(0x02);
+    gif.push_back((char) 0xFF);
+    gif += std::string(255, 'x');
+    gif.push_back(0x00);
+  }
+  gif.push_back(0x3B);
+  return gif;
+}
+
+// A gif that really decodes: frame n is solid black, red, green or blue for
+// n % 4. Each pair of pixels is coded right after a clear code, so the LZW
+// codes never grow past three bits.
+inline std::string SolidGif(int width, int height, int frames) {
+  auto append16 = [](std::string *out, int value) {
+    out->push_back(value & 0xFF);
+    out->push_back((value >> 8) & 0xFF);
+  };
+  std::string gif = "GIF89a";
+  append16(&gif, width);
+  append16(&gif, height);
+  // A four color global table.
+  gif += std::string("\x81\x00\x00", 3);
+  gif += std::string("\x00\x00\x00\xFF\x00\x00\x00\xFF\x00\x00\x00\xFF", 12);
+  const int kClear = 4;
+  const int kEnd = 5;
+  for (int frame = 0; frame < frames; ++frame) {
+    std::vector<int> codes;
+    for (int pixel = 0; pixel < width * height; ++pixel) {
+      if (pixel % 2 == 0) {
+        codes.push_back(kClear);
+      }
+      codes.push_back(frame % 4);
+    }
+    codes.push_back(kEnd);
+    std::string data;
+    uint32_t bits = 0;
+    int count = 0;
+    for (int code : codes) {
+      bits |= code << count;
+      count += 3;
+      while (count >= 8) {
+        data.push_back(bits & 0xFF);
+        bits >>= 8;
+        count -= 8;
+      }
+    }
+    if (count > 0) {
+      data.push_back(bits & 0xFF);
+    }
+
+    gif.push_back(0x2C);
+    append16(&gif, 0);
+    append16(&gif, 0);
+    append16(&gif, width);
+    append16(&gif, height);
+    gif.push_back(0x00);
+    gif.push_back(0x02);
+    for (size_t pos = 0; pos < data.size(); pos += 255) {
+      size_t length = std::min<size_t>(255, data.size() - pos);
+      gif.push_back((char) length);
+      gif += data.substr(pos, length);
+    }
+    gif.push_back(0x00);
+  }
+  gif.push_back(0x3B);
+  return gif;
+}
+
+#endif /* SRC_TEST_UTIL_H_ */
@@ -0,0 +1,110 @@
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "tensorflow/core/platform/test.h"
+
+#include "test-util.h"
+#include "trace.h"
+
+namespace {
+
+const int kRingSize = 256;
+
+// Turns tracing on, once for the whole test binary since init starts the
+// dump thread, and returns the directory dumps go to.
+std::string StartTrace() {
+  static std::string dir = [] {
+    std::string dir = tensorflow::testing::TmpDir() + "/trace-test";
+    mkdir(dir.c_str(), 0755);
+    Config *config = LoadTestConfig("trace-test", {
+      {"trace", {
+        {"enabled", true},
+        {"sample-every", 1},
+        {"ring-size", kRingSize},
+        {"dump-interval-ms", 0},
+        {"dump-dir", dir}
+      }}
+    });
+    Trace::init(config);
+    return dir;
+  }();
+  return dir;
+}
+
+// Writers keep recording while dumps copy their rings; under
+// -fsanitize=thread this must stay quiet, and every dump must still be valid.
+TEST(TraceTest, DumpsWhileRecording) {
+  std::string dir = StartTrace();
+
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> writers;
+  for (int i = 0; i < 4; ++i) {
+    writers.emplace_back([&stop, i] {
+      std::string image = "image-" + std::to_string(i) + ".jpg";
+      while (!stop) {
+        TraceSpan span("stage", image);
+      }
+    });
+  }
+  const int dumps = 50;
+  for (int i = 0; i < dumps; ++i) {
+    Trace::dump();
+  }
+  stop = true;
+  for (auto &writer : writers) {
+    writer.join();
+  }
+  Trace::dump();
+
+  // Every ring is full by now, so the last dump holds all of each.
+  std::string path = dir + "/trace-" + std::to_string(getpid()) + "-" +
+    std::to_string(dumps) + ".json";
+  std::ifstream file(path);
+  ASSERT_TRUE(file.good()) << path;
+  nlohmann::json trace = nlohmann::json::parse(file);
+  EXPECT_EQ(4u * kRingSize, trace["traceEvents"].size());
+  for (auto &event : trace["traceEvents"]) {
+    EXPECT_EQ("stage", event["name"].get<std::string>());
+    EXPECT_EQ(0u, event["args"]["image"].get<std::string>().find("image-"));
+  }
+}
+
+// Threads that come and go, like per-connection ones, take over the rings of
+// threads that have exited instead of adding one each.
+TEST(TraceTest, ReusesRingsOfExitedThreads) {
+  StartTrace();
+  auto record = [](int thread) {
+    std::string image = "thread-" + std::to_string(thread) + ".jpg";
+    TraceSpan span("stage", image);
+  };
+  std::thread(record, 0).join();
+  size_t rings = Trace::ringCount();
+  for (int thread = 1; thread < 100; ++thread) {
+    std::thread(record, thread).join();
+  }
+  EXPECT_EQ(rings, Trace::ringCount());
+
+  // Two at once need two rings, and no more.
+  std::atomic<int> started(0);
+  auto overlap = [&started](int thread) {
+    std::string image = "overlap-" + std::to_string(thread) + ".jpg";
+    { TraceSpan span("stage", image); }
+    started++;
+    while (started < 2) {
+      std::this_thread::yield();
+    }
+  };
+  std::thread first(overlap, 0);
+  std::thread second(overlap, 1);
+  first.join();
+  second.join();
+  EXPECT_LE(Trace::ringCount(), std::max<size_t>(rings, 2));
+}
+
+}  // namespace
@@ -0,0 +1,209 @@
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <fstream>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <glog/logging.h>
+#include <ch-cpp-utils/thread-pool.hpp>
+
+#include "trace.h"
+
+using ChCppUtils::ThreadJob;
+using ChCppUtils::ThreadPool;
+
+static Config *traceConfig = nullptr;
+static bool traceEnabled = false;
+static uint32_t traceSampleEvery = 1;
+static size_t traceRingSize = 4096;
+static std::chrono::steady_clock::time_point traceEpoch;
+static std::atomic<bool> traceDumpRequested(false);
+static std::atomic<uint64_t> traceDumps(0);
+static std::mutex traceRingsLock;
+static ThreadPool *traceDumpPool = nullptr;
+
+std::vector<Trace::Ring *> Trace::rings;
+
+void Trace::init(Config *config) {
+  traceConfig = config;
+  traceEnabled = config->getTraceEnabled();
+  traceSampleEvery = std::max<uint32_t>(1, config->getTraceSampleEvery());
+  traceRingSize = std::max<size_t>(16, config->getTraceRingSize());
+  traceEpoch = std::chrono::steady_clock::now();
+  if (!traceEnabled) {
+    return;
+  }
+  signal(SIGUSR1, Trace::onSignal);
+  traceDumpPool = new ThreadPool (1, false);
+  ThreadJob *job = new ThreadJob (Trace::_dumpRoutine, NULL);
+  traceDumpPool->addJob(job);
+  LOG(INFO) << "Tracing 1 in " << traceSampleEvery <<
+    " images, kill -USR1 " << getpid() << " to dump";
+}
+
+bool Trace::sampled(const std::string &image) {
+  if (!traceEnabled || image.empty()) {
+    return false;
+  }
+  return std::hash<std::string>()(image) % traceSampleEvery == 0;
+}
+
+int64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - traceEpoch).count();
+}
+
+// The calling thread's ring: one given back by a thread that has exited if
+// there is one, else a new one, registered on first use.
+Trace::Ring *Trace::ring() {
+  static thread_local RingOwner owner;
+  if (owner.ring == nullptr) {
+    std::lock_guard<std::mutex> lock(traceRingsLock);
+    for (Ring *r : rings) {
+      if (!r->owned) {
+        owner.ring = r;
+        break;
+      }
+    }
+    if (owner.ring == nullptr) {
+      owner.ring = new Ring();
+      owner.ring->events.resize(traceRingSize);
+      owner.ring->head = 0;
+      rings.push_back(owner.ring);
+    }
+    owner.ring->owned = true;
+    std::lock_guard<std::mutex> ring_lock(owner.ring->lock);
+    owner.ring->tid = syscall(SYS_gettid);
+  }
+  return owner.ring;
+}
+
+Trace::RingOwner::~RingOwner() {
+  if (ring != nullptr) {
+    std::lock_guard<std::mutex> lock(traceRingsLock);
+    ring->owned = false;
+  }
+}
+
+size_t Trace::ringCount() {
+  std::lock_guard<std::mutex> lock(traceRingsLock);
+  return rings.size();
+}
+
+void Trace::record(const char *name, const std::string &image,
+                   int64_t startUs, int64_t endUs) {
+  if (!sampled(image)) {
+    return;
+  }
+  Ring *r = ring();
+  std::lock_guard<std::mutex> lock(r->lock);
+  Event &event = r->events[r->head % r->events.size()];
+  event.name = name;
+  event.tid = r->tid;
+  event.startUs = startUs;
+  event.durationUs = endUs - startUs;
+  // Keep the tail of the path, it's the part that tells images apart.
+  size_t offset = image.length() >= kImageLength ?
+    image.length() - kImageLength + 1 : 0;
+  strncpy(event.image, image.c_str() + offset, kImageLength - 1);
+  event.image[kImageLength - 1] = '\0';
+  r->head++;
+}
+
+static void WriteEscaped(std::ofstream &out, const char *text) {
+  for (const char *c = text; *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      out << '\\' << *c;
+    } else if ((unsigned char) *c < 0x20) {
+      out << ' ';
+    } else {
+      out << *c;
+    }
+  }
+}
+
+void Trace::dump() {
+  if (!traceEnabled) {
+    return;
+  }
+  std::string path = traceConfig->getTraceDumpDir() + "/trace-" +
+    std::to_string(getpid()) + "-" + std::to_string(traceDumps++) + ".json";
+  std::ofstream out(path, std::ios::trunc);
+  if (!out) {
+    LOG(ERROR) << "Unable to write trace " << path;
+    return;
+  }
+
+  std::vector<Ring *> snapshot;
+  {
+    std::lock_guard<std::mutex> lock(traceRingsLock);
+    snapshot = rings;
+  }
+
+  int pid = getpid();
+  size_t written = 0;
+  out << "{\"traceEvents\":[";
+  std::vector<Event> events;
+  for (Ring *r : snapshot) {
+    // Copied out under the ring's lock, so the owner waits for a memcpy at
+    // most, never for the file write.
+    {
+      std::lock_guard<std::mutex> lock(r->lock);
+      size_t size = r->events.size();
+      uint64_t first = r->head > size ? r->head - size : 0;
+      events.clear();
+      for (uint64_t pos = first; pos < r->head; ++pos) {
+        events.push_back(r->events[pos % size]);
+      }
+    }
+    for (const Event &event : events) {
+      out << (written++ ? ",\n" : "\n") << "{\"name\":\"" << event.name <<
+        "\",\"cat\":\"image\",\"ph\":\"X\",\"ts\":" << event.startUs <<
+        ",\"dur\":" << event.durationUs << ",\"pid\":" << pid <<
+        ",\"tid\":" << event.tid << ",\"args\":{\"image\":\"";
+      WriteEscaped(out, event.image);
+      out << "\"}}";
+    }
+  }
+  out << "\n]}\n";
+  LOG(INFO) << "Wrote " << written << " trace events to " << path;
+}
+
+void Trace::onSignal(int signal) {
+  traceDumpRequested = true;
+}
+
+void * Trace::_dumpRoutine (void *arg, struct event_base *base) {
+  std::chrono::milliseconds tick(100);
+  int64_t interval = traceConfig->getTraceDumpIntervalMs() * 1000LL;
+  int64_t last = now();
+  while (true) {
+    std::this_thread::sleep_for(tick);
+    if (traceDumpRequested.exchange(false) ||
+        (interval > 0 && now() - last >= interval)) {
+      dump();
+      last = now();
+    }
+  }
+  return NULL;
+}
+
+TraceSpan::TraceSpan(const char *name, const std::string &image) :
+    name(name), image(image) {
+  startUs = Trace::sampled(image) ? Trace::now() : -1;
+}
+
+TraceSpan::~TraceSpan() {
+  end();
+}
+
+void TraceSpan::end() {
+  if (startUs < 0) {
+    return;
+  }
+  Trace::record(name, image, startUs, Trace::now());
+  startUs = -1;
+}
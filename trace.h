@@ -0,0 +1,81 @@
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "config.h"
+
+// Per-image tracing of pipeline stages. Each thread records spans into its
+// own fixed size ring; old spans are overwritten. A ring's lock is only ever
+// contended while a dump copies that ring out, so recording stays cheap.
+// When a thread exits its ring is handed to the next new thread, with its
+// spans kept, so short-lived connection and reader threads don't each leave
+// a ring behind; there are only ever as many as threads recording at once. The
+// rings are dumped as Chrome trace_event JSON (chrome://tracing, Perfetto) on
+// SIGUSR1 and every "trace.dump-interval-ms".
+//
+// Whether an image is traced depends only on a hash of its name, so every
+// stage makes the same sampling decision without passing anything along.
+class Trace {
+private:
+  static const size_t kImageLength = 64;
+
+  struct Event {
+    const char *name;
+    int tid;
+    int64_t startUs;
+    int64_t durationUs;
+    char image[kImageLength];
+  };
+
+  struct Ring {
+    int tid;
+    std::mutex lock;
+    std::vector<Event> events;
+    uint64_t head;
+    // Whether a live thread records into it; guarded by the rings lock.
+    bool owned;
+  };
+
+  // Gives the ring back when its thread exits.
+  struct RingOwner {
+    Ring *ring = nullptr;
+    ~RingOwner();
+  };
+
+  static std::vector<Ring *> rings;
+
+  static Ring *ring();
+  static void *_dumpRoutine (void *arg, struct event_base *base);
+  static void onSignal(int signal);
+public:
+  static void init(Config *config);
+  static bool sampled(const std::string &image);
+  // Microseconds on the trace clock.
+  static int64_t now();
+  static void record(const char *name, const std::string &image,
+        int64_t startUs, int64_t endUs);
+  static void dump();
+  // Rings allocated so far.
+  static size_t ringCount();
+};
+
+// Records the span from construction to end() or destruction, if the image is
+// sampled.
+class TraceSpan {
+private:
+  const char *name;
+  const std::string &image;
+  int64_t startUs;
+public:
+  TraceSpan(const char *name, const std::string &image);
+  ~TraceSpan();
+  void end();
+};
+
+#endif /* SRC_TRACE_H_ */